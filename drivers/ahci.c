@@ -0,0 +1,573 @@
+#include "../include/ahci.h"
+#include "../include/ata.h"
+#include "../include/blockdev.h"
+#include "../include/pci.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+#include "../include/timer.h"
+#include "../include/vga.h"
+
+// Spin bound for polling with interrupts off, when the tick stands still
+#define AHCI_POLL_SPINS 1000000
+
+typedef struct {
+    blockdev_t dev;
+    volatile uint8_t* regs;         // Port register block
+    ahci_cmd_header_t* cmd_list;
+    uint8_t* fis;
+    ahci_cmd_table_t* tables;
+    uint8_t* bounce;                // For buffers the HBA cannot address
+
+    // Drive features from IDENTIFY
+    bool ncq;
+    uint32_t ncq_depth;
+    bool fua;
+    bool flush;
+    bool trim;
+    uint16_t trim_max_blocks;
+
+    // Slots with a command issued, and the request each one carries.
+    // Queued and non-queued commands never mix.
+    uint32_t busy;
+    bool busy_queued;
+    blockdev_request_t* slot_req[AHCI_MAX_SLOTS];
+
+    // Progress watchdog for busy slots
+    uint32_t progress_tick;
+    uint32_t idle_polls;
+} ahci_port_t;
+
+// Capabilities of the controller being probed
+static uint32_t ahci_slots = 1;
+static bool ahci_sncq = false;
+static ahci_port_t ahci_ports[AHCI_MAX_DEVICES];
+static int ahci_port_count = 0;
+
+static uint32_t ahci_read_reg(volatile uint8_t* base, uint32_t reg) {
+    return *(volatile uint32_t*)(base + reg);
+}
+
+static void ahci_write_reg(volatile uint8_t* base, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(base + reg) = value;
+}
+
+static bool ahci_wait_clear(volatile uint8_t* base, uint32_t reg, uint32_t mask) {
+    uint32_t start = timer_ticks();
+    uint32_t spins = AHCI_POLL_SPINS;
+    while (--spins) {
+        if (!(ahci_read_reg(base, reg) & mask)) {
+            return true;
+        }
+        if (timer_ticks() - start >= AHCI_TIMEOUT_MS) {
+            break;
+        }
+    }
+    return false;
+}
+
+static bool ahci_port_stop(volatile uint8_t* regs) {
+    uint32_t cmd = ahci_read_reg(regs, AHCI_PxCMD);
+    ahci_write_reg(regs, AHCI_PxCMD, cmd & ~AHCI_PxCMD_ST);
+    if (!ahci_wait_clear(regs, AHCI_PxCMD, AHCI_PxCMD_CR)) {
+        return false;
+    }
+
+    cmd = ahci_read_reg(regs, AHCI_PxCMD);
+    ahci_write_reg(regs, AHCI_PxCMD, cmd & ~AHCI_PxCMD_FRE);
+    return ahci_wait_clear(regs, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+static void ahci_port_start(volatile uint8_t* regs) {
+    ahci_wait_clear(regs, AHCI_PxCMD, AHCI_PxCMD_CR);
+
+    uint32_t cmd = ahci_read_reg(regs, AHCI_PxCMD);
+    cmd |= AHCI_PxCMD_FRE | AHCI_PxCMD_SUD | AHCI_PxCMD_POD;
+    ahci_write_reg(regs, AHCI_PxCMD, cmd);
+    ahci_write_reg(regs, AHCI_PxCMD, cmd | AHCI_PxCMD_ST);
+}
+
+// Fail everything in flight and restart the command list. Restarting the
+// port clears PxCI and PxSACT.
+static void ahci_port_recover(ahci_port_t* port) {
+    ahci_port_stop(port->regs);
+    ahci_write_reg(port->regs, AHCI_PxSERR, 0xFFFFFFFF);
+    ahci_write_reg(port->regs, AHCI_PxIS, 0xFFFFFFFF);
+    ahci_port_start(port->regs);
+
+    uint32_t busy = port->busy;
+    port->busy = 0;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (busy & (1u << slot)) {
+            blockdev_request_t* req = port->slot_req[slot];
+            port->slot_req[slot] = NULL;
+            blockdev_complete(req, false);
+        }
+    }
+}
+
+// Reap finished slots. A queued command leaves PxCI once the drive has
+// accepted it and PxSACT once its data is done.
+static void ahci_port_poll(ahci_port_t* port) {
+    if (!port->busy) {
+        return;
+    }
+
+    uint32_t is = ahci_read_reg(port->regs, AHCI_PxIS);
+    if (is & AHCI_PxIS_ERRORS) {
+        vga_writestr("AHCI Error: Command failed\n");
+        ahci_port_recover(port);
+        return;
+    }
+
+    uint32_t active = ahci_read_reg(port->regs, AHCI_PxCI) | ahci_read_reg(port->regs, AHCI_PxSACT);
+    uint32_t done = port->busy & ~active;
+    if (!done) {
+        if (timer_ticks() - port->progress_tick >= AHCI_TIMEOUT_MS ||
+            ++port->idle_polls >= AHCI_POLL_SPINS) {
+            vga_writestr("AHCI Error: Command timeout\n");
+            ahci_port_recover(port);
+        }
+        return;
+    }
+
+    if (is) {
+        ahci_write_reg(port->regs, AHCI_PxIS, is);
+    }
+    port->busy &= ~done;
+    port->progress_tick = timer_ticks();
+    port->idle_polls = 0;
+
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (done & (1u << slot)) {
+            blockdev_request_t* req = port->slot_req[slot];
+            port->slot_req[slot] = NULL;
+            blockdev_complete(req, true);
+        }
+    }
+}
+
+// A free slot for the next command, waiting for completions if needed.
+// Queued commands use the slot number as their NCQ tag.
+static uint32_t ahci_alloc_slot(ahci_port_t* port, bool queued) {
+    uint32_t limit = queued ? port->ncq_depth : 1;
+
+    for (;;) {
+        if (!port->busy || (queued && port->busy_queued)) {
+            for (uint32_t slot = 0; slot < limit; slot++) {
+                if (!(port->busy & (1u << slot))) {
+                    return slot;
+                }
+            }
+        }
+        ahci_port_poll(port);
+    }
+}
+
+// Split the buffer into PRD entries of at most 4 MiB
+static uint16_t ahci_build_prdt(ahci_cmd_table_t* table, void* buffer, uint32_t bytes) {
+    uint32_t addr = (uint32_t)buffer;
+    uint16_t n = 0;
+
+    while (bytes > 0 && n < AHCI_PRDT_ENTRIES) {
+        uint32_t chunk = bytes < AHCI_PRD_MAX_BYTES ? bytes : AHCI_PRD_MAX_BYTES;
+        table->prdt[n].dba = addr;
+        table->prdt[n].dbau = 0;
+        table->prdt[n].reserved = 0;
+        table->prdt[n].dbc = chunk - 1;
+        addr += chunk;
+        bytes -= chunk;
+        n++;
+    }
+    return n;
+}
+
+// Fill the register H2D FIS and the command header, then issue the slot.
+// FPDMA commands carry the sector count in the features field and the
+// tag in the count field.
+static void ahci_issue(ahci_port_t* port, blockdev_request_t* req, uint8_t command,
+                       uint16_t features, uint64_t lba, uint32_t count, void* buffer,
+                       uint32_t bytes, bool write, bool queued, uint8_t device) {
+    uint32_t slot = ahci_alloc_slot(port, queued);
+    ahci_cmd_header_t* header = &port->cmd_list[slot];
+    ahci_cmd_table_t* table = &port->tables[slot];
+
+    uint8_t* fis = table->cfis;
+    memset(fis, 0, sizeof(table->cfis));
+    fis[0] = AHCI_FIS_REG_H2D;
+    fis[1] = 0x80;              // Command, not device control
+    fis[2] = command;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = device;
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    if (queued) {
+        fis[3] = (uint8_t)count;
+        fis[11] = (uint8_t)(count >> 8);
+        fis[12] = (uint8_t)(slot << 3);
+    } else {
+        fis[3] = (uint8_t)features;
+        fis[11] = (uint8_t)(features >> 8);
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+    }
+
+    header->flags = AHCI_CMDH_CFL_H2D | (write ? AHCI_CMDH_WRITE : 0);
+    header->prdtl = ahci_build_prdt(table, buffer, bytes);
+    header->prdbc = 0;
+
+    if (!port->busy) {
+        port->progress_tick = timer_ticks();
+        port->idle_polls = 0;
+    }
+    port->slot_req[slot] = req;
+    port->busy |= 1u << slot;
+    port->busy_queued = queued;
+
+    // The HBA fetches the command table once the slot is issued
+    asm volatile("" ::: "memory");
+    if (queued) {
+        ahci_write_reg(port->regs, AHCI_PxSACT, 1u << slot);
+    }
+    ahci_write_reg(port->regs, AHCI_PxCI, 1u << slot);
+}
+
+static bool ahci_submit(blockdev_t* dev, blockdev_request_t* req);
+
+// Run one request to completion, for the synchronous entry points
+static bool ahci_run(ahci_port_t* port, blockdev_request_t* req) {
+    req->done = false;
+    req->callback = NULL;
+    req->dev = NULL;
+    ahci_submit(&port->dev, req);
+    while (!req->done) {
+        ahci_port_poll(port);
+    }
+    return req->success;
+}
+
+// Run a request with an odd buffer through the bounce buffer, a piece
+// at a time
+static bool ahci_run_bounced(ahci_port_t* port, const blockdev_request_t* req) {
+    uint8_t* buf = (uint8_t*)req->buffer;
+    uint64_t lba = req->lba;
+    uint32_t count = req->count;
+
+    while (count > 0) {
+        uint32_t chunk = count < AHCI_BOUNCE_SECTORS ? count : AHCI_BOUNCE_SECTORS;
+        blockdev_request_t step;
+        memset(&step, 0, sizeof(step));
+        step.op = req->op;
+        step.flags = req->flags;
+        step.lba = lba;
+        step.count = chunk;
+        step.buffer = port->bounce;
+
+        if (req->op == BLOCKDEV_OP_WRITE) {
+            memcpy(port->bounce, buf, chunk * 512);
+        }
+        if (!ahci_run(port, &step)) {
+            return false;
+        }
+        if (req->op == BLOCKDEV_OP_READ) {
+            memcpy(buf, port->bounce, chunk * 512);
+        }
+        lba += chunk;
+        count -= chunk;
+        buf += chunk * 512;
+    }
+    return true;
+}
+
+static bool ahci_submit(blockdev_t* dev, blockdev_request_t* req) {
+    ahci_port_t* port = (ahci_port_t*)dev->driver_data;
+
+    if (req->op == BLOCKDEV_OP_FLUSH) {
+        if (!port->flush) {
+            blockdev_complete(req, true);
+            return true;
+        }
+        ahci_issue(port, req, AHCI_CMD_FLUSH_CACHE_EXT, 0, 0, 0, NULL, 0, false, false, AHCI_DEV_LBA);
+        return true;
+    }
+
+    if (req->count == 0 || req->count > AHCI_MAX_SECTORS) {
+        vga_writestr("AHCI Error: Bad transfer\n");
+        blockdev_complete(req, false);
+        return false;
+    }
+
+    if ((uint32_t)req->buffer & 1) {
+        bool ok = ahci_run_bounced(port, req);
+        blockdev_complete(req, ok);
+        return ok;
+    }
+
+    bool write = req->op == BLOCKDEV_OP_WRITE;
+    bool fua = write && (req->flags & BLOCKDEV_WRITE_FUA);
+    uint32_t bytes = req->count * 512;
+
+    if (port->ncq) {
+        ahci_issue(port, req, write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA, 0,
+                   req->lba, req->count, req->buffer, bytes, write, true,
+                   AHCI_DEV_LBA | (fua ? AHCI_DEV_FUA : 0));
+        return true;
+    }
+
+    if (fua && !port->fua) {
+        // No native FUA, follow the write with a cache flush
+        blockdev_request_t step = *req;
+        step.flags &= ~BLOCKDEV_WRITE_FUA;
+        bool ok = ahci_run(port, &step);
+        if (ok) {
+            step.op = BLOCKDEV_OP_FLUSH;
+            ok = ahci_run(port, &step);
+        }
+        blockdev_complete(req, ok);
+        return ok;
+    }
+
+    uint8_t command = !write ? AHCI_CMD_READ_DMA_EXT :
+                      fua ? AHCI_CMD_WRITE_DMA_FUA_EXT : AHCI_CMD_WRITE_DMA_EXT;
+    ahci_issue(port, req, command, 0, req->lba, req->count, req->buffer, bytes, write, false, AHCI_DEV_LBA);
+    return true;
+}
+
+static void ahci_poll(blockdev_t* dev) {
+    ahci_port_poll((ahci_port_t*)dev->driver_data);
+}
+
+static bool ahci_transfer(blockdev_t* dev, uint8_t op, uint64_t lba, uint32_t count,
+                          void* buffer, uint32_t flags) {
+    ahci_port_t* port = (ahci_port_t*)dev->driver_data;
+    uint8_t* buf = (uint8_t*)buffer;
+
+    while (count > 0) {
+        uint32_t chunk = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+        blockdev_request_t req;
+        memset(&req, 0, sizeof(req));
+        req.op = op;
+        req.flags = flags;
+        req.lba = lba;
+        req.count = chunk;
+        req.buffer = buf;
+        if (!ahci_run(port, &req)) {
+            return false;
+        }
+        lba += chunk;
+        count -= chunk;
+        buf += chunk * 512;
+    }
+    return true;
+}
+
+static bool ahci_blockdev_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return ahci_transfer(dev, BLOCKDEV_OP_READ, lba, count, buffer, 0);
+}
+
+static bool ahci_blockdev_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    return ahci_transfer(dev, BLOCKDEV_OP_WRITE, lba, count, (void*)buffer, flags);
+}
+
+static bool ahci_blockdev_flush(blockdev_t* dev) {
+    blockdev_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.op = BLOCKDEV_OP_FLUSH;
+    return ahci_run((ahci_port_t*)dev->driver_data, &req);
+}
+
+// Ranges go out as DATA SET MANAGEMENT TRIM, up to the payload blocks the
+// drive takes per command. A queued command cannot be mixed with it, so
+// ahci_issue waits for the port to go idle first.
+static bool ahci_blockdev_discard(blockdev_t* dev, const blockdev_range_t* ranges, uint32_t count) {
+    static uint64_t payload[ATA_TRIM_ENTRIES * ATA_TRIM_MAX_BLOCKS] __attribute__((aligned(512)));
+    ahci_port_t* port = (ahci_port_t*)dev->driver_data;
+
+    if (!port->trim) {
+        return true;
+    }
+
+    uint32_t max_blocks = port->trim_max_blocks;
+    if (max_blocks > ATA_TRIM_MAX_BLOCKS) {
+        max_blocks = ATA_TRIM_MAX_BLOCKS;
+    }
+
+    uint32_t range = 0;
+    uint32_t offset = 0;
+    for (;;) {
+        memset(payload, 0, sizeof(payload));
+        uint32_t n = ata_trim_pack(payload, max_blocks * ATA_TRIM_ENTRIES, ranges, count, &range, &offset);
+        if (n == 0) {
+            return true;
+        }
+
+        uint32_t blocks = (n + ATA_TRIM_ENTRIES - 1) / ATA_TRIM_ENTRIES;
+        blockdev_request_t req;
+        memset(&req, 0, sizeof(req));
+        ahci_issue(port, &req, AHCI_CMD_DSM, ATA_DSM_TRIM, 0, blocks, payload, blocks * 512,
+                   true, false, AHCI_DEV_LBA);
+        while (!req.done) {
+            ahci_port_poll(port);
+        }
+        if (!req.success) {
+            vga_writestr("AHCI Error: TRIM failed\n");
+            return false;
+        }
+    }
+}
+
+static const blockdev_ops_t ahci_blockdev_ops = {
+    .read = ahci_blockdev_read,
+    .write = ahci_blockdev_write,
+    .flush = ahci_blockdev_flush,
+    .submit = ahci_submit,
+    .poll = ahci_poll,
+    .discard = ahci_blockdev_discard,
+};
+
+static bool ahci_identify(ahci_port_t* port) {
+    static uint16_t identify[256] __attribute__((aligned(4)));
+    blockdev_request_t req;
+    memset(&req, 0, sizeof(req));
+
+    ahci_issue(port, &req, AHCI_CMD_IDENTIFY, 0, 0, 0, identify, sizeof(identify), false, false, 0);
+    while (!req.done) {
+        ahci_port_poll(port);
+    }
+    if (!req.success) {
+        return false;
+    }
+
+    // Word 83 bit 10: 48-bit addressing, which every command here uses
+    if (!(identify[83] & (1 << 10))) {
+        vga_writestr("AHCI Error: Drive lacks LBA48\n");
+        return false;
+    }
+    port->dev.sector_count = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+                             ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+
+    // Word 76 bit 8: NCQ, word 75: queue depth - 1
+    port->ncq = ahci_sncq && (identify[76] & (1 << 8));
+    port->ncq_depth = (identify[75] & 0x1F) + 1;
+    if (port->ncq_depth > ahci_slots) {
+        port->ncq_depth = ahci_slots;
+    }
+
+    port->flush = (identify[83] & (1 << 13)) != 0;
+    port->fua = (identify[84] & (1 << 6)) != 0;
+
+    // Word 169 bit 0: TRIM, word 105: payload blocks per command
+    port->trim = (identify[169] & 0x01) != 0;
+    port->trim_max_blocks = identify[105] ? identify[105] : 1;
+    return true;
+}
+
+static bool ahci_port_init(volatile uint8_t* regs) {
+    ahci_port_t* port = &ahci_ports[ahci_port_count];
+    memset(port, 0, sizeof(*port));
+    port->regs = regs;
+
+    if (!ahci_port_stop(regs)) {
+        vga_writestr("AHCI Error: Port will not stop\n");
+        return false;
+    }
+
+    // Command list is 1 KiB aligned, FIS area 256 bytes, tables 128
+    port->cmd_list = kmalloc_aligned(AHCI_MAX_SLOTS * sizeof(ahci_cmd_header_t), 1024);
+    port->fis = kmalloc_aligned(256, 256);
+    port->tables = kmalloc_aligned(ahci_slots * sizeof(ahci_cmd_table_t), 128);
+    port->bounce = kmalloc_aligned(AHCI_BOUNCE_SECTORS * 512, 512);
+    if (!port->cmd_list || !port->fis || !port->tables || !port->bounce) {
+        vga_writestr("AHCI Error: Out of memory\n");
+        return false;
+    }
+    memset(port->cmd_list, 0, AHCI_MAX_SLOTS * sizeof(ahci_cmd_header_t));
+    memset(port->fis, 0, 256);
+    memset(port->tables, 0, ahci_slots * sizeof(ahci_cmd_table_t));
+
+    for (uint32_t slot = 0; slot < ahci_slots; slot++) {
+        port->cmd_list[slot].ctba = (uint32_t)&port->tables[slot];
+        port->cmd_list[slot].ctbau = 0;
+    }
+
+    ahci_write_reg(regs, AHCI_PxCLB, (uint32_t)port->cmd_list);
+    ahci_write_reg(regs, AHCI_PxCLBU, 0);
+    ahci_write_reg(regs, AHCI_PxFB, (uint32_t)port->fis);
+    ahci_write_reg(regs, AHCI_PxFBU, 0);
+    ahci_write_reg(regs, AHCI_PxSERR, 0xFFFFFFFF);
+    ahci_write_reg(regs, AHCI_PxIS, 0xFFFFFFFF);
+    ahci_write_reg(regs, AHCI_PxIE, 0);    // Completions are polled
+    ahci_port_start(regs);
+
+    if (!ahci_identify(port)) {
+        return false;
+    }
+
+    strcpy(port->dev.name, "ahci0");
+    port->dev.name[4] = '0' + ahci_port_count;
+    port->dev.sector_size = 512;
+    port->dev.ops = &ahci_blockdev_ops;
+    port->dev.driver_data = port;
+
+    if (!blockdev_register(&port->dev)) {
+        return false;
+    }
+
+    ahci_port_count++;
+    return true;
+}
+
+static bool ahci_probe(pci_device_t* pci) {
+    // Memory is identity mapped, the ABAR is usable as is
+    const pci_bar_t* bar5 = &pci->bars[5];
+    if (bar5->io || bar5->base == 0) {
+        return false;
+    }
+    volatile uint8_t* abar = (volatile uint8_t*)bar5->base;
+    pci_enable_device(pci, true);
+
+    uint32_t ghc = ahci_read_reg(abar, AHCI_HBA_GHC);
+    ahci_write_reg(abar, AHCI_HBA_GHC, (ghc | AHCI_GHC_AE) & ~AHCI_GHC_IE);
+
+    uint32_t cap = ahci_read_reg(abar, AHCI_HBA_CAP);
+    ahci_slots = ((cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+    ahci_sncq = (cap & AHCI_CAP_SNCQ) != 0;
+
+    uint32_t implemented = ahci_read_reg(abar, AHCI_HBA_PI);
+    for (uint32_t i = 0; i < AHCI_MAX_PORTS && ahci_port_count < AHCI_MAX_DEVICES; i++) {
+        if (!(implemented & (1u << i))) {
+            continue;
+        }
+
+        volatile uint8_t* regs = abar + AHCI_PORT_BASE + i * AHCI_PORT_SIZE;
+        uint32_t ssts = ahci_read_reg(regs, AHCI_PxSSTS);
+        if ((ssts & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_OK ||
+            ((ssts >> AHCI_SSTS_IPM_SHIFT) & 0x0F) != AHCI_SSTS_IPM_ACTIVE ||
+            ahci_read_reg(regs, AHCI_PxSIG) != AHCI_SIG_ATA) {
+            continue;   // Empty port or not a disk
+        }
+
+        ahci_port_init(regs);
+    }
+
+    // Claim the controller even without disks, nobody else can use it
+    return true;
+}
+
+static const pci_device_id_t ahci_ids[] = {
+    { PCI_ANY_ID, PCI_ANY_ID, (AHCI_PCI_CLASS << 8) | AHCI_PCI_SUBCLASS },
+    { 0, 0, 0 },
+};
+
+static pci_driver_t ahci_driver = {
+    .name = "ahci",
+    .ids = ahci_ids,
+    .probe = ahci_probe,
+};
+
+int ahci_init(void) {
+    pci_register_driver(&ahci_driver);
+    return ahci_port_count;
+}
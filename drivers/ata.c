@@ -1,161 +1,1151 @@
 #include "../include/ata.h"
 #include "../include/io.h"
 #include "../include/vga.h"
+#include "../include/pci.h"
+#include "../include/idt.h"
+#include "../include/timer.h"
+#include "../include/string.h"
+#include "../include/blockdev.h"
 
+struct ata_drive;
+
+typedef struct {
+    uint16_t io;                // Command block ports
+    uint16_t ctrl;              // Control block port
+    uint16_t bm;                // Bus master registers, 0 without DMA
+    uint8_t irq;
+    ata_prd_t* prdt;
+    int selected;               // Drive the select register points at, -1 unknown
+
+    // Completion state, filled in by the interrupt handler
+    bool irq_installed;
+    volatile bool irq_pending;
+    volatile uint8_t irq_status;
+    volatile uint8_t irq_bm_status;
+
+    // Asynchronous DMA: the request in flight and the ones waiting for
+    // the channel. Requests run one after another, split into commands.
+    blockdev_request_t* active;
+    struct ata_drive* active_drive;
+    uint32_t active_done;       // Sectors finished
+    uint32_t active_chunk;      // Sectors in the command in flight
+    bool active_flush;          // Running the flush that emulates FUA
+    uint32_t active_tick;
+    uint32_t active_polls;
+    blockdev_request_t* pending_head;
+    blockdev_request_t* pending_tail;
+} ata_channel_t;
+
+typedef struct ata_drive {
+    blockdev_t dev;
+    ata_channel_t* channel;
+    uint8_t slave;
+    bool present;
+
+    // Drive descriptor from IDENTIFY
+    ata_device_info_t info;
+
+    // Write cache control, a zero flush command means nothing to flush
+    uint8_t flush_cmd;
+
+    // DRQ block size set with SET MULTIPLE
+    uint16_t multiple;
+} ata_drive_t;
+
+// One PRD table per channel, each a 4 KiB page
+static ata_prd_t ata_prdt[ATA_CHANNELS][ATA_PRDT_ENTRIES] __attribute__((aligned(4096)));
+
+static ata_channel_t ata_channels[ATA_CHANNELS] = {
+    { .io = ATA_PRIMARY_IO, .ctrl = ATA_PRIMARY_CTRL, .irq = IRQ_ATA_PRIMARY,
+      .prdt = ata_prdt[0], .selected = -1 },
+    { .io = ATA_SECONDARY_IO, .ctrl = ATA_SECONDARY_CTRL, .irq = IRQ_ATA_SECONDARY,
+      .prdt = ata_prdt[1], .selected = -1 },
+};
+
+static ata_drive_t ata_drives[ATA_DRIVES];
+static int ata_drive_count = 0;
 static bool ata_initialized = false;
 
-static void ata_400ns_delay(void) {
-    inb(ATA_STATUS);
-    inb(ATA_STATUS);
-    inb(ATA_STATUS);
-    inb(ATA_STATUS);
+// Bus master controller state. DMA is only used once a drive accepted a
+// DMA mode (info.dma).
+static bool ata_dma_available = false;
+static bool ata_dma_disabled = false;
+static int ata_ctrl_udma_max = -1;     // Fastest UDMA mode of the controller
+
+static void ata_400ns_delay(ata_channel_t* ch) {
+    inb(ch->ctrl + ATA_ALTSTATUS);
+    inb(ch->ctrl + ATA_ALTSTATUS);
+    inb(ch->ctrl + ATA_ALTSTATUS);
+    inb(ch->ctrl + ATA_ALTSTATUS);
+}
+
+static void ata_channel_irq(ata_channel_t* ch) {
+    if (ch->bm) {
+        ch->irq_bm_status = inb(ch->bm + ATA_BM_STATUS);
+    }
+    // Reading the status register acknowledges INTRQ
+    ch->irq_status = inb(ch->io + ATA_STATUS);
+    ch->irq_pending = true;
+}
+
+static void ata_primary_irq(struct registers_t* regs) {
+    (void)regs;
+    ata_channel_irq(&ata_channels[0]);
+}
+
+static void ata_secondary_irq(struct registers_t* regs) {
+    (void)regs;
+    ata_channel_irq(&ata_channels[1]);
+}
+
+// Syscalls run with interrupts off, those fall back to polling
+static bool ata_use_irq(ata_channel_t* ch) {
+    return ch->irq_installed && interrupts_enabled();
+}
+
+// Point the drive/head register at a drive. Switching drives needs the
+// settle delay before the status is meaningful.
+static void ata_select(ata_drive_t* drive, uint8_t bits) {
+    ata_channel_t* ch = drive->channel;
+    outb(ch->io + ATA_DRIVEHEAD, bits | (drive->slave ? ATA_DH_SLAVE : 0));
+    if (ch->selected != drive->slave) {
+        ata_400ns_delay(ch);
+        ch->selected = drive->slave;
+    }
+}
+
+// Clear the pending flag first so a fast device cannot beat the waiter
+static void ata_send_command(ata_channel_t* ch, uint8_t command) {
+    ch->irq_pending = false;
+    outb(ch->io + ATA_COMMAND, command);
 }
 
-static bool ata_wait_not_busy(void) {
-    uint32_t timeout = 100000;
-    while (--timeout) {
-        uint8_t status = inb(ATA_STATUS);
+// Sleep in HLT until the channel's IRQ arrives, the timer tick bounds the wait
+static bool ata_wait_irq(ata_channel_t* ch) {
+    uint32_t start = timer_ticks();
+
+    asm volatile("cli");
+    while (!ch->irq_pending) {
+        if (timer_ticks() - start >= ATA_TIMEOUT_MS) {
+            asm volatile("sti");
+            return false;
+        }
+        asm volatile("sti; hlt; cli");
+    }
+    ch->irq_pending = false;
+    asm volatile("sti");
+    return true;
+}
+
+// Polling fallback. Timer ticks bound the wait when interrupts are on,
+// the spin count when they are off and the tick count stands still.
+static bool ata_wait_not_busy(ata_channel_t* ch) {
+    uint32_t start = timer_ticks();
+    uint32_t spins = ATA_POLL_SPINS;
+    while (--spins) {
+        uint8_t status = inb(ch->io + ATA_STATUS);
         if (!(status & ATA_SR_BSY)) {
             return true;
         }
-        ata_400ns_delay();
+        if (timer_ticks() - start >= ATA_TIMEOUT_MS) {
+            break;
+        }
     }
     return false;
 }
 
-static bool ata_wait_drq(void) {
-    uint32_t timeout = 100000;
-    while (--timeout) {
-        uint8_t status = inb(ATA_STATUS);
-        if (status & ATA_SR_DRQ) {
-            return true;
+static bool ata_wait_drq(ata_channel_t* ch) {
+    uint32_t start = timer_ticks();
+    uint32_t spins = ATA_POLL_SPINS;
+    while (--spins) {
+        uint8_t status = inb(ch->io + ATA_STATUS);
+        if (!(status & ATA_SR_BSY)) {
+            if (status & ATA_SR_DRQ) {
+                return true;
+            }
+            if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+                return false;
+            }
+        }
+        if (timer_ticks() - start >= ATA_TIMEOUT_MS) {
+            break;
         }
-        ata_400ns_delay();
     }
     return false;
 }
 
-bool ata_init(void) {
-    if (ata_initialized) {
+// Wait for the device to finish a command or a data block
+static bool ata_wait_complete(ata_channel_t* ch) {
+    // A lost interrupt falls through to polling
+    if (ata_use_irq(ch) && ata_wait_irq(ch)) {
+        if (ch->irq_status & (ATA_SR_ERR | ATA_SR_DF)) {
+            return false;
+        }
+    }
+    return ata_wait_not_busy(ch);
+}
+
+// Non-blocking check whether the DMA command in flight has ended
+static bool ata_dma_finished(ata_channel_t* ch) {
+    uint8_t bm_status = inb(ch->bm + ATA_BM_STATUS);
+    if (bm_status & ATA_BM_SR_ERR) {
         return true;
     }
+    if ((bm_status & ATA_BM_SR_IRQ) || !(bm_status & ATA_BM_SR_ACTIVE)) {
+        return !(inb(ch->ctrl + ATA_ALTSTATUS) & ATA_SR_BSY);
+    }
+    return false;
+}
 
-    // Select drive 0
-    outb(ATA_DRIVEHEAD, 0xA0);
-    ata_400ns_delay();
+static bool ata_wait_dma(ata_channel_t* ch) {
+    if (ata_use_irq(ch) && ata_wait_irq(ch)) {
+        if (ch->irq_bm_status & ATA_BM_SR_ERR) {
+            return false;
+        }
+        return ata_wait_not_busy(ch);
+    }
 
-    // Check if drive exists
-    if (!ata_wait_not_busy()) {
-        vga_writestr("ATA Error: Drive busy timeout\n");
+    uint32_t start = timer_ticks();
+    uint32_t spins = ATA_POLL_SPINS;
+    while (--spins) {
+        if (ata_dma_finished(ch)) {
+            return true;
+        }
+        if (timer_ticks() - start >= ATA_TIMEOUT_MS) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Look for a PCI IDE controller with bus mastering (PIIX under QEMU)
+static void ata_dma_init(void) {
+    pci_device_t* ide = pci_find_class(0x01, 0x01);
+    if (!ide) {
+        return;
+    }
+
+    // Bit 7 of the programming interface marks a bus master capable controller
+    if (!(ide->prog_if & 0x80)) {
+        return;
+    }
+
+    const pci_bar_t* bar4 = &ide->bars[4];
+    if (!bar4->io || bar4->base == 0) {
+        return;
+    }
+
+    pci_enable_device(ide, true);
+    ata_channels[0].bm = (uint16_t)bar4->base;
+    ata_channels[1].bm = (uint16_t)bar4->base + ATA_BM_SECONDARY;
+
+    // PIIX3 stops at multiword DMA, PIIX4 at UDMA/33. Assume UDMA/100
+    // for anything newer.
+    if (ide->vendor_id == 0x8086 && ide->device_id == 0x7010) {
+        ata_ctrl_udma_max = -1;
+    } else if (ide->vendor_id == 0x8086 && ide->device_id == 0x7111) {
+        ata_ctrl_udma_max = 2;
+    } else {
+        ata_ctrl_udma_max = 5;
+    }
+
+    // Clear any stale error/interrupt flags
+    for (int i = 0; i < ATA_CHANNELS; i++) {
+        outb(ata_channels[i].bm + ATA_BM_COMMAND, 0);
+        outb(ata_channels[i].bm + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    }
+
+    ata_dma_available = true;
+}
+
+// Build the PRD table for a buffer, splitting at 64 KiB boundaries.
+// Memory is identity mapped, so the buffer is physically contiguous.
+static bool ata_build_prdt(ata_channel_t* ch, const void* buffer, uint32_t bytes) {
+    uint32_t addr = (uint32_t)buffer;
+    int entry = 0;
+
+    while (bytes > 0) {
+        if (entry >= ATA_PRDT_ENTRIES) {
+            return false;
+        }
+
+        uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+
+        ch->prdt[entry].base = addr;
+        ch->prdt[entry].byte_count = (uint16_t)(chunk & 0xFFFF);
+        ch->prdt[entry].flags = 0;
+
+        addr += chunk;
+        bytes -= chunk;
+        entry++;
+    }
+
+    ch->prdt[entry - 1].flags = ATA_PRD_EOT;
+    return true;
+}
+
+// Load the task file. LBA48 writes the high order bytes first, then the
+// low order bytes through the same registers.
+static void ata_setup_task_file(ata_drive_t* drive, uint64_t lba, uint32_t sector_count, bool lba48) {
+    uint16_t io = drive->channel->io;
+
+    if (lba48) {
+        ata_select(drive, 0x40);
+        outb(io + ATA_SECCOUNT0, (uint8_t)(sector_count >> 8));
+        outb(io + ATA_SECTOR, (uint8_t)(lba >> 24));
+        outb(io + ATA_LCYL, (uint8_t)(lba >> 32));
+        outb(io + ATA_HCYL, (uint8_t)(lba >> 40));
+    } else {
+        ata_select(drive, 0xE0 | ((lba >> 24) & 0x0F));
+    }
+
+    // A count of 0 means 256 (LBA28) or 65536 (LBA48) sectors
+    outb(io + ATA_SECCOUNT0, (uint8_t)sector_count);
+    outb(io + ATA_SECTOR, (uint8_t)lba);
+    outb(io + ATA_LCYL, (uint8_t)(lba >> 8));
+    outb(io + ATA_HCYL, (uint8_t)(lba >> 16));
+}
+
+// Short requests below the 28-bit limit keep the cheaper LBA28 commands
+static bool ata_needs_lba48(uint64_t lba, uint32_t sector_count) {
+    return sector_count > ATA_LBA28_MAX_SECTORS ||
+           lba + sector_count > ATA_LBA28_LIMIT;
+}
+
+// Load the PRD table and program the bus master, without starting it
+static bool ata_dma_setup(ata_channel_t* ch, const void* buffer, uint32_t bytes, bool write) {
+    if (!ata_build_prdt(ch, buffer, bytes)) {
+        vga_writestr("ATA Error: DMA buffer too fragmented\n");
         return false;
     }
 
-    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
-    ata_400ns_delay();
+    if (!ata_wait_not_busy(ch)) {
+        vga_writestr("ATA Error: Drive busy before DMA\n");
+        return false;
+    }
 
-    if (!ata_wait_drq()) {
-        vga_writestr("ATA Error: Drive not ready\n");
+    // Program the bus master: stop, set direction, reset flags, load PRDT
+    outb(ch->bm + ATA_BM_COMMAND, write ? 0 : ATA_BM_CMD_READ);
+    outb(ch->bm + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    outl(ch->bm + ATA_BM_PRDT, (uint32_t)ch->prdt);
+    return true;
+}
+
+// Start the engine once the command has been written
+static void ata_dma_go(ata_channel_t* ch, bool write) {
+    // Make sure the buffer contents are in memory before the engine starts
+    asm volatile("" ::: "memory");
+    outb(ch->bm + ATA_BM_COMMAND, (write ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
+}
+
+// Program the bus master and issue the DMA command, without waiting
+static bool ata_dma_start(ata_drive_t* drive, uint64_t lba, uint32_t sector_count,
+                          void* buffer, bool write, bool fua) {
+    ata_channel_t* ch = drive->channel;
+
+    // FUA only exists as an EXT command
+    bool lba48 = fua || ata_needs_lba48(lba, sector_count);
+
+    if (!ata_dma_setup(ch, buffer, sector_count * 512, write)) {
         return false;
     }
 
-    // Read and discard identify data
-    for (int i = 0; i < 256; i++) {
-        inw(ATA_DATA);
+    ata_setup_task_file(drive, lba, sector_count, lba48);
+    if (fua) {
+        ata_send_command(ch, ATA_CMD_WRITE_DMA_FUA_EXT);
+    } else if (lba48) {
+        ata_send_command(ch, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    } else {
+        ata_send_command(ch, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
     }
 
-    ata_initialized = true;
+    ata_dma_go(ch, write);
     return true;
 }
 
-bool ata_read_sectors(uint32_t lba, uint8_t sector_count, void* buffer) {
-    if (!ata_initialized) {
-        vga_writestr("ATA Error: Drive not initialized\n");
+// Stop the engine and acknowledge the interrupt on both sides
+static bool ata_dma_finish(ata_channel_t* ch) {
+    uint8_t bm_cmd = inb(ch->bm + ATA_BM_COMMAND) & ATA_BM_CMD_READ;
+    outb(ch->bm + ATA_BM_COMMAND, bm_cmd);
+    uint8_t bm_status = inb(ch->bm + ATA_BM_STATUS);
+    uint8_t status = inb(ch->io + ATA_STATUS);
+    outb(ch->bm + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    ch->irq_pending = false;
+    asm volatile("" ::: "memory");
+
+    if ((bm_status & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+        vga_writestr("ATA Error: DMA transfer failed\n");
         return false;
     }
+    return true;
+}
 
-    if (!buffer) {
-        vga_writestr("ATA Error: Invalid buffer\n");
+static bool ata_dma_complete(ata_channel_t* ch) {
+    bool ok = ata_wait_dma(ch);
+    if (!ata_dma_finish(ch)) {
         return false;
     }
+    if (!ok) {
+        vga_writestr("ATA Error: DMA transfer failed\n");
+    }
+    return ok;
+}
 
-    // Wait for drive ready
-    if (!ata_wait_not_busy()) {
-        vga_writestr("ATA Error: Drive busy before read\n");
+static bool ata_dma_transfer(ata_drive_t* drive, uint64_t lba, uint32_t sector_count,
+                             void* buffer, bool write, bool fua) {
+    if (!ata_dma_start(drive, lba, sector_count, buffer, write, fua)) {
+        return false;
+    }
+    return ata_dma_complete(drive->channel);
+}
+
+// DATA SET MANAGEMENT is a DMA command whose payload is the range list.
+// Its feature and count registers are 16 bits, high byte first.
+static bool ata_trim_blocks(ata_drive_t* drive, const void* payload, uint32_t blocks) {
+    ata_channel_t* ch = drive->channel;
+
+    if (!ata_dma_setup(ch, payload, blocks * 512, true)) {
         return false;
     }
 
-    // Send drive select and LBA
-    outb(ATA_DRIVEHEAD, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECCOUNT0, sector_count);
-    outb(ATA_SECTOR, (uint8_t)lba);
-    outb(ATA_LCYL, (uint8_t)(lba >> 8));
-    outb(ATA_HCYL, (uint8_t)(lba >> 16));
+    ata_setup_task_file(drive, 0, blocks, true);
+    outb(ch->io + ATA_FEATURES, 0);
+    outb(ch->io + ATA_FEATURES, ATA_DSM_TRIM);
+    ata_send_command(ch, ATA_CMD_DSM);
 
-    // Send read command
-    outb(ATA_COMMAND, ATA_CMD_READ_PIO);
+    ata_dma_go(ch, true);
+    return ata_dma_complete(ch);
+}
 
-    uint16_t* buf = (uint16_t*)buffer;
-    for (int s = 0; s < sector_count; s++) {
-        if (!ata_wait_drq()) {
-            vga_writestr("ATA Error: Data not ready\n");
-            return false;
+// Move one DRQ block through the data port
+static void ata_pio_block(ata_drive_t* drive, void* buffer, uint32_t sectors, bool write) {
+    uint16_t port = drive->channel->io + ATA_DATA;
+
+    if (drive->info.pio32) {
+        if (write) {
+            outsl(port, buffer, sectors * 128);
+        } else {
+            insl(port, buffer, sectors * 128);
         }
+    } else {
+        if (write) {
+            outsw(port, buffer, sectors * 256);
+        } else {
+            insw(port, buffer, sectors * 256);
+        }
+    }
+}
 
-        // Read sector
-        for (int i = 0; i < 256; i++) {
-            buf[i + (s * 256)] = inw(ATA_DATA);
+static uint8_t ata_pio_command(ata_drive_t* drive, bool lba48, bool write, bool fua) {
+    if (fua) {
+        return ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+    }
+    if (drive->multiple > 1) {
+        if (write) {
+            return lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
         }
+        return lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    }
+    if (write) {
+        return lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO;
+    }
+    return lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO;
+}
+
+// PIO data phase. With READ/WRITE MULTIPLE the drive asks for data once
+// per block of drive->multiple sectors instead of once per sector.
+static bool ata_pio_transfer(ata_drive_t* drive, uint64_t lba, uint32_t sector_count,
+                             void* buffer, bool write, bool fua) {
+    ata_channel_t* ch = drive->channel;
+    bool lba48 = fua || ata_needs_lba48(lba, sector_count);
+
+    // Wait for drive ready
+    if (!ata_wait_not_busy(ch)) {
+        vga_writestr(write ? "ATA Error: Drive busy before write\n"
+                           : "ATA Error: Drive busy before read\n");
+        return false;
+    }
+
+    ata_setup_task_file(drive, lba, sector_count, lba48);
+    ata_send_command(ch, ata_pio_command(drive, lba48, write, fua));
+
+    uint8_t* buf = (uint8_t*)buffer;
+    uint32_t remaining = sector_count;
+    while (remaining > 0) {
+        uint32_t block = remaining < drive->multiple ? remaining : drive->multiple;
+
+        if (write) {
+            // The first block is requested without an interrupt
+            if (!ata_wait_drq(ch)) {
+                vga_writestr("ATA Error: Drive not ready for write\n");
+                return false;
+            }
+            ata_pio_block(drive, buf, block, true);
+
+            // The drive interrupts once the block has been taken
+            if (!ata_wait_complete(ch)) {
+                vga_writestr("ATA Error: Write timeout\n");
+                return false;
+            }
+        } else {
+            // The drive interrupts once per block when data is ready
+            if (!ata_wait_complete(ch) || !ata_wait_drq(ch)) {
+                vga_writestr("ATA Error: Data not ready\n");
+                return false;
+            }
+            ata_pio_block(drive, buf, block, false);
+        }
+
+        buf += block * 512;
+        remaining -= block;
     }
 
     return true;
 }
 
-bool ata_write_sectors(uint32_t lba, uint8_t sector_count, const void* buffer) {
-    if (!ata_initialized) {
-        vga_writestr("ATA Error: Drive not initialized\n");
+// Pick the largest DRQ block the drive allows for READ/WRITE MULTIPLE
+static void ata_multiple_init(ata_drive_t* drive) {
+    ata_channel_t* ch = drive->channel;
+    uint16_t max_multiple = drive->info.max_multiple;
+
+    drive->multiple = 1;
+    if (max_multiple <= 1) {
+        return;
+    }
+
+    ata_select(drive, 0xA0);
+    outb(ch->io + ATA_SECCOUNT0, (uint8_t)max_multiple);
+    ata_send_command(ch, ATA_CMD_SET_MULTIPLE);
+
+    if (ata_wait_not_busy(ch) && !(inb(ch->io + ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
+        drive->multiple = max_multiple;
+    }
+}
+
+static bool ata_set_xfer_mode(ata_drive_t* drive, uint8_t mode) {
+    ata_channel_t* ch = drive->channel;
+
+    ata_select(drive, 0xA0);
+    outb(ch->io + ATA_FEATURES, ATA_FEATURE_XFER_MODE);
+    outb(ch->io + ATA_SECCOUNT0, mode);
+    ata_send_command(ch, ATA_CMD_SET_FEATURES);
+
+    if (!ata_wait_not_busy(ch) || (inb(ch->io + ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
         return false;
     }
+    drive->info.xfer_mode = mode;
+    return true;
+}
+
+static int ata_highest_mode(uint8_t modes, int limit) {
+    for (int mode = limit; mode >= 0; mode--) {
+        if (modes & (1 << mode)) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+// Program the fastest mode both the drive and the controller support:
+// UDMA, then multiword DMA, then the best PIO mode
+static void ata_select_mode(ata_drive_t* drive) {
+    ata_device_info_t* info = &drive->info;
+    int udma = ata_dma_available ? ata_highest_mode(info->udma_modes, ata_ctrl_udma_max) : -1;
+    int mwdma = ata_dma_available ? ata_highest_mode(info->mwdma_modes, 2) : -1;
+    int pio = ata_highest_mode(info->pio_modes, 4);
+
+    info->dma = false;
+    info->xfer_mode = ATA_XFER_PIO;
+
+    if (udma >= 0 && ata_set_xfer_mode(drive, ATA_XFER_UDMA | udma)) {
+        info->dma = true;
+    } else if (mwdma >= 0 && ata_set_xfer_mode(drive, ATA_XFER_MWDMA | mwdma)) {
+        info->dma = true;
+    } else if (pio > 0) {
+        ata_set_xfer_mode(drive, ATA_XFER_PIO | pio);
+    }
+}
+
+static bool ata_do_flush(ata_drive_t* drive) {
+    ata_channel_t* ch = drive->channel;
+
+    if (!drive->flush_cmd) {
+        return true;
+    }
+
+    if (!ata_wait_not_busy(ch)) {
+        vga_writestr("ATA Error: Drive busy before flush\n");
+        return false;
+    }
+
+    ata_select(drive, 0xA0);
+    ata_send_command(ch, drive->flush_cmd);
+    if (!ata_wait_complete(ch)) {
+        vga_writestr("ATA Error: Cache flush failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool ata_use_dma(ata_drive_t* drive, const void* buffer) {
+    // The PRD base must be word aligned, odd buffers go through PIO
+    return drive->info.dma && !ata_dma_disabled && !((uint32_t)buffer & 1);
+}
+
+static uint32_t ata_max_sectors(ata_drive_t* drive, bool dma) {
+    uint32_t max_sectors = drive->info.lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+    if (dma && max_sectors > ATA_DMA_MAX_SECTORS) {
+        max_sectors = ATA_DMA_MAX_SECTORS;
+    }
+    return max_sectors;
+}
+
+// PIO FUA needs WRITE MULTIPLE, drives without it get write + flush
+static bool ata_native_fua(ata_drive_t* drive, bool dma) {
+    return drive->info.fua && (dma || drive->multiple > 1);
+}
 
+// Split a request into commands the drive and the PRD table can take.
+// The caller owns the channel.
+static bool ata_do_transfer(ata_drive_t* drive, uint64_t lba, uint32_t sector_count,
+                            void* buffer, bool write, bool fua) {
     if (!buffer) {
         vga_writestr("ATA Error: Invalid buffer\n");
         return false;
     }
 
-    // Wait for drive ready
-    if (!ata_wait_not_busy()) {
-        vga_writestr("ATA Error: Drive busy before write\n");
+    if (lba + sector_count > drive->info.sectors) {
+        vga_writestr("ATA Error: LBA out of range\n");
         return false;
     }
 
-    // Send drive select and LBA
-    outb(ATA_DRIVEHEAD, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECCOUNT0, sector_count);
-    outb(ATA_SECTOR, (uint8_t)lba);
-    outb(ATA_LCYL, (uint8_t)(lba >> 8));
-    outb(ATA_HCYL, (uint8_t)(lba >> 16));
+    bool dma = ata_use_dma(drive, buffer);
+    uint32_t max_sectors = ata_max_sectors(drive, dma);
+    bool native_fua = fua && ata_native_fua(drive, dma);
+
+    uint8_t* buf = (uint8_t*)buffer;
+    while (sector_count > 0) {
+        uint32_t chunk = sector_count < max_sectors ? sector_count : max_sectors;
+
+        bool ok = dma ? ata_dma_transfer(drive, lba, chunk, buf, write, native_fua)
+                      : ata_pio_transfer(drive, lba, chunk, buf, write, native_fua);
+        if (!ok) {
+            return false;
+        }
+
+        lba += chunk;
+        buf += chunk * 512;
+        sector_count -= chunk;
+    }
+
+    if (fua && !native_fua) {
+        return ata_do_flush(drive);
+    }
+
+    return true;
+}
+
+// Reset both drives of a channel after a command hung
+static void ata_channel_reset(ata_channel_t* ch) {
+    if (ch->bm) {
+        outb(ch->bm + ATA_BM_COMMAND, 0);
+        outb(ch->bm + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    }
+    outb(ch->ctrl + ATA_CONTROL, ATA_CTRL_SRST);
+    ata_400ns_delay(ch);
+    outb(ch->ctrl + ATA_CONTROL, 0);
+    ch->selected = -1;
+    ata_wait_not_busy(ch);
+}
+
+// Issue the next command of the active request: a DMA chunk, or the
+// flush behind the last chunk of an emulated FUA write
+static bool ata_channel_issue(ata_channel_t* ch) {
+    blockdev_request_t* req = ch->active;
+    ata_drive_t* drive = ch->active_drive;
+
+    ch->active_tick = timer_ticks();
+    ch->active_polls = 0;
+
+    if (req->op == BLOCKDEV_OP_FLUSH || ch->active_flush) {
+        if (!ata_wait_not_busy(ch)) {
+            return false;
+        }
+        ata_select(drive, 0xA0);
+        ata_send_command(ch, drive->flush_cmd);
+        return true;
+    }
+
+    bool write = req->op == BLOCKDEV_OP_WRITE;
+    bool fua = write && (req->flags & BLOCKDEV_WRITE_FUA) && ata_native_fua(drive, true);
+    uint32_t remaining = req->count - ch->active_done;
+    uint32_t max_sectors = ata_max_sectors(drive, true);
+
+    ch->active_chunk = remaining < max_sectors ? remaining : max_sectors;
+    return ata_dma_start(drive, req->lba + ch->active_done, ch->active_chunk,
+                         (uint8_t*)req->buffer + ch->active_done * 512, write, fua);
+}
 
-    // Send write command
-    outb(ATA_COMMAND, ATA_CMD_WRITE_PIO);
+// Only DMA and flushes run in the background, PIO needs the CPU anyway
+static bool ata_async_capable(ata_drive_t* drive, blockdev_request_t* req) {
+    if (req->op == BLOCKDEV_OP_FLUSH) {
+        return drive->flush_cmd != 0;
+    }
+    return ata_use_dma(drive, req->buffer);
+}
 
-    const uint16_t* buf = (const uint16_t*)buffer;
-    for (int s = 0; s < sector_count; s++) {
-        if (!ata_wait_drq()) {
-            vga_writestr("ATA Error: Drive not ready for write\n");
+static bool ata_run_now(ata_drive_t* drive, blockdev_request_t* req) {
+    switch (req->op) {
+        case BLOCKDEV_OP_READ:
+            return ata_do_transfer(drive, req->lba, req->count, req->buffer, false, false);
+        case BLOCKDEV_OP_WRITE:
+            return ata_do_transfer(drive, req->lba, req->count, req->buffer, true,
+                                   (req->flags & BLOCKDEV_WRITE_FUA) != 0);
+        case BLOCKDEV_OP_FLUSH:
+            return ata_do_flush(drive);
+        default:
             return false;
+    }
+}
+
+// Start waiting requests until one is left running on the hardware
+static void ata_channel_start(ata_channel_t* ch) {
+    while (!ch->active && ch->pending_head) {
+        blockdev_request_t* req = ch->pending_head;
+        ch->pending_head = req->next;
+        if (!ch->pending_head) {
+            ch->pending_tail = NULL;
+        }
+        req->next = NULL;
+
+        ata_drive_t* drive = (ata_drive_t*)req->dev->driver_data;
+        if (!ata_async_capable(drive, req)) {
+            blockdev_complete(req, ata_run_now(drive, req));
+            continue;
+        }
+
+        ch->active = req;
+        ch->active_drive = drive;
+        ch->active_done = 0;
+        ch->active_chunk = 0;
+        ch->active_flush = false;
+        if (!ata_channel_issue(ch)) {
+            ch->active = NULL;
+            blockdev_complete(req, false);
         }
+    }
+}
 
-        // Write sector
-        for (int i = 0; i < 256; i++) {
-            outw(ATA_DATA, buf[i + (s * 256)]);
+static void ata_channel_end(ata_channel_t* ch, bool ok) {
+    blockdev_request_t* req = ch->active;
+    ch->active = NULL;
+    blockdev_complete(req, ok);
+    ata_channel_start(ch);
+}
+
+// Advance the channel's active request once its command has ended
+static void ata_channel_service(ata_channel_t* ch) {
+    blockdev_request_t* req = ch->active;
+    if (!req) {
+        return;
+    }
+
+    bool flush = req->op == BLOCKDEV_OP_FLUSH || ch->active_flush;
+    bool finished = flush ? !(inb(ch->ctrl + ATA_ALTSTATUS) & ATA_SR_BSY) : ata_dma_finished(ch);
+    if (!finished) {
+        if (timer_ticks() - ch->active_tick >= ATA_TIMEOUT_MS ||
+            ++ch->active_polls >= ATA_POLL_SPINS) {
+            vga_writestr("ATA Error: Command timeout\n");
+            ata_channel_reset(ch);
+            ata_channel_end(ch, false);
         }
+        return;
+    }
 
-        // Flush write cache
-        outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
-        if (!ata_wait_not_busy()) {
+    bool ok;
+    if (flush) {
+        ok = !(inb(ch->io + ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF));
+        ch->irq_pending = false;
+        if (!ok) {
             vga_writestr("ATA Error: Cache flush failed\n");
+        }
+    } else {
+        ok = ata_dma_finish(ch);
+    }
+
+    if (ok && req->op != BLOCKDEV_OP_FLUSH && !ch->active_flush) {
+        ch->active_done += ch->active_chunk;
+
+        bool more = ch->active_done < req->count;
+        if (!more && req->op == BLOCKDEV_OP_WRITE && (req->flags & BLOCKDEV_WRITE_FUA) &&
+            !ata_native_fua(ch->active_drive, true) && ch->active_drive->flush_cmd) {
+            ch->active_flush = true;
+            more = true;
+        }
+        if (more) {
+            if (ata_channel_issue(ch)) {
+                return;
+            }
+            ok = false;
+        }
+    }
+
+    ata_channel_end(ch, ok);
+}
+
+// Wait for the background work of a channel before using it directly
+static void ata_channel_idle(ata_channel_t* ch) {
+    while (ch->active || ch->pending_head) {
+        ata_channel_service(ch);
+        ata_channel_start(ch);
+    }
+}
+
+static ata_drive_t* ata_get_drive(int drive) {
+    if (!ata_initialized || drive < 0 || drive >= ATA_DRIVES || !ata_drives[drive].present) {
+        return NULL;
+    }
+    return &ata_drives[drive];
+}
+
+static bool ata_transfer(int index, uint64_t lba, uint32_t sector_count, void* buffer,
+                         bool write, bool fua) {
+    ata_drive_t* drive = ata_get_drive(index);
+    if (!drive) {
+        vga_writestr("ATA Error: Drive not initialized\n");
+        return false;
+    }
+
+    ata_channel_idle(drive->channel);
+    return ata_do_transfer(drive, lba, sector_count, buffer, write, fua);
+}
+
+// Commit the drive's volatile write cache to the medium. Writes do not
+// flush on their own, callers issue this at their consistency points.
+bool ata_flush(int index) {
+    ata_drive_t* drive = ata_get_drive(index);
+    if (!drive) {
+        vga_writestr("ATA Error: Drive not initialized\n");
+        return false;
+    }
+
+    ata_channel_idle(drive->channel);
+    return ata_do_flush(drive);
+}
+
+bool ata_dma_enabled(int index) {
+    ata_drive_t* drive = ata_get_drive(index);
+    return drive && drive->info.dma;
+}
+
+// Lets benchmarks compare the PIO path against DMA
+void ata_set_dma_enabled(bool enabled) {
+    ata_dma_disabled = !enabled;
+}
+
+uint16_t ata_multiple_sectors(int index) {
+    ata_drive_t* drive = ata_get_drive(index);
+    return drive ? drive->multiple : 0;
+}
+
+const ata_device_info_t* ata_get_info(int index) {
+    ata_drive_t* drive = ata_get_drive(index);
+    return drive ? &drive->info : NULL;
+}
+
+static bool ata_blockdev_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    ata_drive_t* drive = (ata_drive_t*)dev->driver_data;
+    ata_channel_idle(drive->channel);
+    return ata_do_transfer(drive, lba, count, buffer, false, false);
+}
+
+static bool ata_blockdev_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    ata_drive_t* drive = (ata_drive_t*)dev->driver_data;
+    ata_channel_idle(drive->channel);
+    return ata_do_transfer(drive, lba, count, (void*)buffer, true, (flags & BLOCKDEV_WRITE_FUA) != 0);
+}
+
+static bool ata_blockdev_flush(blockdev_t* dev) {
+    ata_drive_t* drive = (ata_drive_t*)dev->driver_data;
+    ata_channel_idle(drive->channel);
+    return ata_do_flush(drive);
+}
+
+// Requests queue per channel, so the two channels work in parallel while
+// the drives sharing a channel take turns
+static bool ata_blockdev_submit(blockdev_t* dev, blockdev_request_t* req) {
+    ata_drive_t* drive = (ata_drive_t*)dev->driver_data;
+    ata_channel_t* ch = drive->channel;
+
+    req->next = NULL;
+    if (ch->pending_tail) {
+        ch->pending_tail->next = req;
+    } else {
+        ch->pending_head = req;
+    }
+    ch->pending_tail = req;
+
+    ata_channel_start(ch);
+    return true;
+}
+
+static void ata_blockdev_poll(blockdev_t* dev) {
+    ata_channel_service(((ata_drive_t*)dev->driver_data)->channel);
+}
+
+uint32_t ata_trim_pack(uint64_t* entries, uint32_t max_entries, const blockdev_range_t* ranges,
+                       uint32_t count, uint32_t* range, uint32_t* offset) {
+    uint32_t n = 0;
+    while (n < max_entries && *range < count) {
+        const blockdev_range_t* r = &ranges[*range];
+        if (*offset >= r->count) {
+            (*range)++;
+            *offset = 0;
+            continue;
+        }
+
+        uint32_t chunk = r->count - *offset;
+        if (chunk > ATA_TRIM_RANGE_MAX) {
+            chunk = ATA_TRIM_RANGE_MAX;
+        }
+        entries[n++] = (r->lba + *offset) | ((uint64_t)chunk << 48);
+        *offset += chunk;
+    }
+    return n;
+}
+
+// Drives without TRIM, or running without DMA, ignore the hint
+static bool ata_blockdev_discard(blockdev_t* dev, const blockdev_range_t* ranges, uint32_t count) {
+    static uint64_t payload[ATA_TRIM_ENTRIES * ATA_TRIM_MAX_BLOCKS] __attribute__((aligned(512)));
+    ata_drive_t* drive = (ata_drive_t*)dev->driver_data;
+
+    if (!drive->info.trim || !ata_use_dma(drive, payload)) {
+        return true;
+    }
+
+    uint32_t max_blocks = drive->info.trim_max_blocks;
+    if (max_blocks > ATA_TRIM_MAX_BLOCKS) {
+        max_blocks = ATA_TRIM_MAX_BLOCKS;
+    }
+
+    ata_channel_idle(drive->channel);
+
+    uint32_t range = 0;
+    uint32_t offset = 0;
+    for (;;) {
+        // Unused entries must have a zero count
+        memset(payload, 0, sizeof(payload));
+        uint32_t n = ata_trim_pack(payload, max_blocks * ATA_TRIM_ENTRIES, ranges, count, &range, &offset);
+        if (n == 0) {
+            return true;
+        }
+        if (!ata_trim_blocks(drive, payload, (n + ATA_TRIM_ENTRIES - 1) / ATA_TRIM_ENTRIES)) {
+            vga_writestr("ATA Error: TRIM failed\n");
             return false;
         }
     }
+}
+
+static const blockdev_ops_t ata_blockdev_ops = {
+    .read = ata_blockdev_read,
+    .write = ata_blockdev_write,
+    .flush = ata_blockdev_flush,
+    .submit = ata_blockdev_submit,
+    .poll = ata_blockdev_poll,
+    .discard = ata_blockdev_discard,
+};
+
+// IDENTIFY strings are space padded, with the two bytes of each word swapped
+static void ata_ident_string(const uint16_t* identify, int offset, int words, char* out) {
+    const uint16_t* w = &identify[offset / 2];
+    for (int i = 0; i < words; i++) {
+        out[i * 2] = (char)(w[i] >> 8);
+        out[i * 2 + 1] = (char)(w[i] & 0xFF);
+    }
+
+    int len = words * 2;
+    while (len > 0 && out[len - 1] == ' ') {
+        len--;
+    }
+    out[len] = '\0';
+}
+
+static void ata_parse_identify(const uint16_t* identify, ata_device_info_t* info) {
+    ata_ident_string(identify, ATA_IDENT_MODEL, 20, info->model);
+    ata_ident_string(identify, ATA_IDENT_SERIAL, 10, info->serial);
+
+    // Word 83 bit 10 advertises the 48-bit feature set
+    uint16_t cmdset82 = identify[ATA_IDENT_COMMANDSETS / 2];
+    uint16_t cmdset83 = identify[ATA_IDENT_COMMANDSETS / 2 + 1];
+    uint16_t cmdset84 = identify[ATA_IDENT_COMMANDSETS / 2 + 2];
+    uint16_t enabled85 = identify[ATA_IDENT_ENABLED / 2];
+
+    info->lba48 = (cmdset83 & (1 << 10)) != 0;
+    if (info->lba48) {
+        const uint16_t* w = &identify[ATA_IDENT_MAX_LBA_EXT / 2];
+        info->sectors = (uint64_t)w[0] | ((uint64_t)w[1] << 16) |
+                        ((uint64_t)w[2] << 32) | ((uint64_t)w[3] << 48);
+    } else {
+        const uint16_t* w = &identify[ATA_IDENT_MAX_LBA / 2];
+        info->sectors = (uint64_t)w[0] | ((uint64_t)w[1] << 16);
+    }
+
+    // Word 47: READ/WRITE MULTIPLE limit, word 48 bit 0: 32-bit PIO
+    info->max_multiple = identify[ATA_IDENT_MAX_MULTIPLE / 2] & 0xFF;
+    info->pio32 = (identify[ATA_IDENT_DWORD_IO / 2] & 0x01) != 0;
+
+    // PIO 0-2 are mandatory. Word 53 says whether words 64-70 (PIO 3/4)
+    // and word 88 (UDMA) are valid, word 49 bit 8 whether DMA is there.
+    uint16_t valid = identify[ATA_IDENT_FIELDVALID / 2];
+    bool dma = (identify[ATA_IDENT_CAPABILITIES / 2] & (1 << 8)) != 0;
+    info->pio_modes = 0x07;
+    if (valid & 0x02) {
+        info->pio_modes |= (identify[ATA_IDENT_PIO_MODES / 2] & 0x03) << 3;
+    }
+    info->mwdma_modes = dma ? identify[ATA_IDENT_MWDMA / 2] & 0x07 : 0;
+    info->udma_modes = dma && (valid & 0x04) ? identify[ATA_IDENT_UDMA / 2] & 0x7F : 0;
 
+    // Words 82-85: write cache, FLUSH CACHE (EXT) and FUA writes
+    info->write_cache = (cmdset82 & (1 << 5)) != 0;
+    info->write_cache_enabled = (enabled85 & (1 << 5)) != 0;
+    info->flush = (cmdset83 & (1 << 12)) != 0;
+    info->flush_ext = info->lba48 && (cmdset83 & (1 << 13));
+    info->fua = info->lba48 && (cmdset84 & (1 << 6));
+
+    // Word 169 bit 0: TRIM, word 105: payload blocks per command
+    info->trim = info->lba48 && (identify[ATA_IDENT_DSM / 2] & 0x01);
+    info->trim_max_blocks = identify[ATA_IDENT_DSM_BLOCKS / 2];
+    if (info->trim_max_blocks == 0) {
+        info->trim_max_blocks = 1;
+    }
+}
+
+// Issue IDENTIFY DEVICE and keep the parsed reply. Empty positions and
+// ATAPI devices fail quietly.
+static bool ata_identify(ata_drive_t* drive) {
+    ata_channel_t* ch = drive->channel;
+
+    ata_select(drive, 0xA0);
+    ata_send_command(ch, ATA_CMD_IDENTIFY);
+    ata_400ns_delay(ch);
+
+    if (inb(ch->io + ATA_STATUS) == 0) {
+        return false;
+    }
+
+    if (!ata_wait_drq(ch)) {
+        if (inb(ch->io + ATA_LCYL) == ATA_ATAPI_LCYL && inb(ch->io + ATA_HCYL) == ATA_ATAPI_HCYL) {
+            return false;
+        }
+        vga_writestr("ATA Error: Drive not ready\n");
+        return false;
+    }
+
+    uint16_t identify[256];
+    insw(ch->io + ATA_DATA, identify, 256);
+    ata_parse_identify(identify, &drive->info);
+    return true;
+}
+
+static bool ata_probe_drive(ata_drive_t* drive) {
+    ata_channel_t* ch = drive->channel;
+
+    // No device answers at this position
+    ata_select(drive, 0xA0);
+    uint8_t status = inb(ch->io + ATA_STATUS);
+    if (status == 0 || status == 0xFF) {
+        return false;
+    }
+
+    if (!ata_wait_not_busy(ch)) {
+        vga_writestr("ATA Error: Drive busy timeout\n");
+        return false;
+    }
+
+    if (!ata_identify(drive)) {
+        return false;
+    }
+
+    if (drive->info.flush_ext) {
+        drive->flush_cmd = ATA_CMD_CACHE_FLUSH_EXT;
+    } else if (drive->info.flush) {
+        drive->flush_cmd = ATA_CMD_CACHE_FLUSH;
+    } else {
+        drive->flush_cmd = 0;
+    }
+    ata_multiple_init(drive);
+    ata_select_mode(drive);
     return true;
-}
\ No newline at end of file
+}
+
+// Probe all four positions and register each drive as ata<position>
+int ata_init(void) {
+    if (ata_initialized) {
+        return ata_drive_count;
+    }
+
+    ata_dma_init();
+
+    for (int c = 0; c < ATA_CHANNELS; c++) {
+        ata_channel_t* ch = &ata_channels[c];
+
+        // A floating bus reads 0xFF, there is no controller to wait on
+        if (inb(ch->io + ATA_STATUS) == 0xFF) {
+            continue;
+        }
+
+        bool found = false;
+        for (int slave = 0; slave < 2; slave++) {
+            int index = c * 2 + slave;
+            ata_drive_t* drive = &ata_drives[index];
+
+            memset(drive, 0, sizeof(*drive));
+            drive->channel = ch;
+            drive->slave = (uint8_t)slave;
+            if (!ata_probe_drive(drive)) {
+                continue;
+            }
+
+            drive->present = true;
+            strcpy(drive->dev.name, "ata0");
+            drive->dev.name[3] = '0' + index;
+            drive->dev.sector_size = 512;
+            drive->dev.sector_count = drive->info.sectors;
+            drive->dev.ops = &ata_blockdev_ops;
+            drive->dev.driver_data = drive;
+            blockdev_register(&drive->dev);
+
+            ata_drive_count++;
+            found = true;
+        }
+
+        // Enable device interrupts and route the channel's IRQ to the driver
+        if (found) {
+            outb(ch->ctrl + ATA_CONTROL, 0);
+            if (!ch->irq_installed) {
+                irq_install_handler(ch->irq, c == 0 ? ata_primary_irq : ata_secondary_irq);
+                ch->irq_installed = true;
+            }
+        }
+    }
+
+    ata_initialized = ata_drive_count > 0;
+    return ata_drive_count;
+}
+
+bool ata_read_sectors(int drive, uint64_t lba, uint32_t sector_count, void* buffer) {
+    return ata_transfer(drive, lba, sector_count, buffer, false, false);
+}
+
+bool ata_write_sectors(int drive, uint64_t lba, uint32_t sector_count, const void* buffer) {
+    return ata_transfer(drive, lba, sector_count, (void*)buffer, true, false);
+}
+
+// ATA_WRITE_FUA makes the data durable before the call returns
+bool ata_write_sectors_flags(int drive, uint64_t lba, uint32_t sector_count, const void* buffer, uint32_t flags) {
+    return ata_transfer(drive, lba, sector_count, (void*)buffer, true, (flags & ATA_WRITE_FUA) != 0);
+}
@@ -0,0 +1,474 @@
+#include "../include/bcache.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+#include "../include/vga.h"
+#include "../include/timer.h"
+
+static bcache_buf_t* buffers = NULL;
+static bcache_buf_t* hash_table[BCACHE_HASH_SIZE];
+static bcache_buf_t* lru_head = NULL;   // Most recently used
+static bcache_buf_t* lru_tail = NULL;
+static bcache_stats_t stats;
+
+// Write-back state: the staging buffer dirty runs are gathered into, and
+// when the oldest dirty sector was written
+static bool writeback = true;
+static uint8_t* coalesce_buffer = NULL;
+static uint32_t oldest_dirty_tick = 0;
+static bool (*writeback_hook)(blockdev_t* dev) = NULL;
+static bool in_hook = false;            // The hook's own writes skip it
+
+static bool bcache_writeback_all(blockdev_t* dev);
+
+bool bcache_init(uint32_t count) {
+    if (buffers) {
+        return true;
+    }
+    if (count == 0) {
+        count = BCACHE_DEFAULT_BUFFERS;
+    }
+
+    bcache_buf_t* bufs = kmalloc(count * sizeof(bcache_buf_t));
+    uint8_t* data = kmalloc_aligned(count * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    coalesce_buffer = kmalloc_aligned(BCACHE_COALESCE_SECTORS * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    if (!bufs || !data || !coalesce_buffer) {
+        vga_writestr("Cache Error: Out of memory\n");
+        return false;
+    }
+    memset(bufs, 0, count * sizeof(bcache_buf_t));
+    memset(hash_table, 0, sizeof(hash_table));
+
+    // Every buffer sits on the LRU list, the invalid ones are reused first
+    for (uint32_t i = 0; i < count; i++) {
+        bufs[i].data = data + i * BCACHE_BLOCK_SIZE;
+        bufs[i].lru_prev = i > 0 ? &bufs[i - 1] : NULL;
+        bufs[i].lru_next = i + 1 < count ? &bufs[i + 1] : NULL;
+    }
+    lru_head = &bufs[0];
+    lru_tail = &bufs[count - 1];
+    buffers = bufs;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.buffers = count;
+    return true;
+}
+
+static uint32_t bcache_hash(blockdev_t* dev, uint64_t lba) {
+    return ((uint32_t)lba ^ ((uint32_t)dev >> 4)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static bcache_buf_t* bcache_lookup(blockdev_t* dev, uint64_t lba) {
+    for (bcache_buf_t* buf = hash_table[bcache_hash(dev, lba)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->lba == lba) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void bcache_unhash(bcache_buf_t* buf) {
+    bcache_buf_t** link = &hash_table[bcache_hash(buf->dev, buf->lba)];
+    while (*link && *link != buf) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = buf->hash_next;
+    }
+    buf->hash_next = NULL;
+    buf->valid = false;
+    if (buf->dirty) {
+        buf->dirty = false;
+        stats.dirty--;
+    }
+}
+
+static void bcache_lru_unlink(bcache_buf_t* buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        lru_tail = buf->lru_prev;
+    }
+}
+
+static void bcache_touch(bcache_buf_t* buf) {
+    if (buf == lru_head) {
+        return;
+    }
+    bcache_lru_unlink(buf);
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    lru_head->lru_prev = buf;
+    lru_head = buf;
+}
+
+// Dropped buffers go to the cold end of the list to be reused first
+static void bcache_drop(bcache_buf_t* buf) {
+    bcache_unhash(buf);
+    if (buf == lru_tail) {
+        return;
+    }
+    bcache_lru_unlink(buf);
+    buf->lru_next = NULL;
+    buf->lru_prev = lru_tail;
+    lru_tail->lru_next = buf;
+    lru_tail = buf;
+}
+
+// The least recently used clean buffer nobody has pinned. When only
+// dirty ones are left, write them all back and look again.
+static bcache_buf_t* bcache_evict(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (bcache_buf_t* buf = lru_tail; buf; buf = buf->lru_prev) {
+            if (buf->pins || buf->dirty) {
+                continue;
+            }
+            if (buf->valid) {
+                bcache_unhash(buf);
+                stats.evictions++;
+            }
+            return buf;
+        }
+        if (!stats.dirty || !bcache_writeback_all(NULL)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Find or claim the buffer for a sector, without reading it
+static bcache_buf_t* bcache_slot(blockdev_t* dev, uint64_t lba) {
+    if (!buffers && !bcache_init(0)) {
+        return NULL;
+    }
+
+    bcache_buf_t* buf = bcache_lookup(dev, lba);
+    if (buf) {
+        bcache_touch(buf);
+        return buf;
+    }
+
+    buf = bcache_evict();
+    if (!buf) {
+        vga_writestr("Cache Error: All buffers pinned\n");
+        return NULL;
+    }
+    buf->dev = dev;
+    buf->lba = lba;
+    buf->valid = false;
+    bcache_touch(buf);
+    return buf;
+}
+
+static void bcache_insert(bcache_buf_t* buf) {
+    uint32_t h = bcache_hash(buf->dev, buf->lba);
+    buf->hash_next = hash_table[h];
+    hash_table[h] = buf;
+    buf->valid = true;
+}
+
+bcache_buf_t* bcache_get(blockdev_t* dev, uint64_t lba) {
+    bcache_buf_t* buf = bcache_slot(dev, lba);
+    if (!buf) {
+        return NULL;
+    }
+
+    if (buf->valid) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        if (!blockdev_read(dev, lba, 1, buf->data)) {
+            return NULL;
+        }
+        bcache_insert(buf);
+    }
+
+    buf->pins++;
+    return buf;
+}
+
+void bcache_put(bcache_buf_t* buf) {
+    if (buf && buf->pins > 0) {
+        buf->pins--;
+    }
+}
+
+bool bcache_read(blockdev_t* dev, uint64_t lba, void* buffer) {
+    bcache_buf_t* buf = bcache_get(dev, lba);
+    if (!buf) {
+        return false;
+    }
+    memcpy(buffer, buf->data, BCACHE_BLOCK_SIZE);
+    bcache_put(buf);
+    return true;
+}
+
+void bcache_readahead(blockdev_t* dev, uint64_t lba, uint32_t count) {
+    bcache_buf_t* run[BCACHE_COALESCE_SECTORS];
+    uint32_t n = 0;
+
+    if (!buffers && !bcache_init(0)) {
+        return;
+    }
+    // Leave most of the cache to what is already in it
+    if (count > stats.buffers / 4) {
+        count = stats.buffers / 4;
+    }
+    if (count > BCACHE_COALESCE_SECTORS) {
+        count = BCACHE_COALESCE_SECTORS;
+    }
+
+    // Claim and pin the buffers first, eviction may use the staging buffer
+    while (n < count && !bcache_lookup(dev, lba + n)) {
+        bcache_buf_t* buf = bcache_slot(dev, lba + n);
+        if (!buf) {
+            break;
+        }
+        buf->pins++;
+        run[n++] = buf;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    bool ok = blockdev_read(dev, lba, n, coalesce_buffer);
+    for (uint32_t i = 0; i < n; i++) {
+        run[i]->pins--;
+        if (ok) {
+            memcpy(run[i]->data, coalesce_buffer + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+            bcache_insert(run[i]);
+        } else {
+            bcache_drop(run[i]);
+        }
+    }
+    if (ok) {
+        stats.prefetched += n;
+    }
+}
+
+static void bcache_mark_dirty(bcache_buf_t* buf) {
+    if (buf->dirty) {
+        return;
+    }
+    if (!stats.dirty) {
+        oldest_dirty_tick = timer_ticks();
+    }
+    buf->dirty = true;
+    stats.dirty++;
+}
+
+static bool bcache_run_hook(blockdev_t* dev) {
+    if (!writeback_hook || in_hook) {
+        return true;
+    }
+    in_hook = true;
+    bool ok = writeback_hook(dev);
+    in_hook = false;
+    return ok;
+}
+
+// Write-back: the whole sector is replaced, so a miss needs no read.
+// Repeated writes to one sector before the flusher runs cost one write.
+bool bcache_write(blockdev_t* dev, uint64_t lba, const void* buffer, uint32_t flags) {
+    if (writeback && !(flags & BLOCKDEV_WRITE_FUA)) {
+        bcache_buf_t* buf = bcache_slot(dev, lba);
+        if (buf) {
+            memcpy(buf->data, buffer, BCACHE_BLOCK_SIZE);
+            if (!buf->valid) {
+                bcache_insert(buf);
+            }
+            bcache_mark_dirty(buf);
+            return true;
+        }
+        // Every buffer pinned, write through instead
+    }
+
+    // Write-through: a failed write leaves no cached copy behind
+    if (!bcache_run_hook(dev)) {
+        return false;
+    }
+    if (!blockdev_write_flags(dev, lba, 1, buffer, flags)) {
+        bcache_invalidate(dev, lba, 1);
+        return false;
+    }
+
+    bcache_buf_t* buf = bcache_slot(dev, lba);
+    if (buf) {
+        memcpy(buf->data, buffer, BCACHE_BLOCK_SIZE);
+        if (!buf->valid) {
+            bcache_insert(buf);
+        }
+        if (buf->dirty) {
+            buf->dirty = false;
+            stats.dirty--;
+        }
+    }
+    return true;
+}
+
+void bcache_invalidate(blockdev_t* dev, uint64_t lba, uint32_t count) {
+    if (!buffers) {
+        return;
+    }
+
+    // Long ranges are cheaper to check against every buffer
+    if (count > stats.buffers) {
+        for (uint32_t i = 0; i < stats.buffers; i++) {
+            bcache_buf_t* buf = &buffers[i];
+            if (buf->valid && buf->dev == dev && buf->lba >= lba && buf->lba < lba + count) {
+                bcache_drop(buf);
+            }
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t* buf = bcache_lookup(dev, lba + i);
+        if (buf) {
+            bcache_drop(buf);
+        }
+    }
+}
+
+static bcache_buf_t* bcache_dirty_at(blockdev_t* dev, uint64_t lba) {
+    bcache_buf_t* buf = bcache_lookup(dev, lba);
+    return buf && buf->dirty ? buf : NULL;
+}
+
+// Write one run of at most max adjacent dirty sectors starting at buf
+// with a single command, through the staging buffer. Returns the sectors
+// written.
+static uint32_t bcache_write_run(bcache_buf_t* buf, uint32_t max) {
+    bcache_buf_t* run[BCACHE_COALESCE_SECTORS];
+    uint32_t n = 0;
+
+    if (max > BCACHE_COALESCE_SECTORS) {
+        max = BCACHE_COALESCE_SECTORS;
+    }
+    for (bcache_buf_t* next = buf; next && n < max;
+         next = bcache_dirty_at(buf->dev, buf->lba + n)) {
+        memcpy(coalesce_buffer + n * BCACHE_BLOCK_SIZE, next->data, BCACHE_BLOCK_SIZE);
+        run[n++] = next;
+    }
+
+    if (!blockdev_write(buf->dev, buf->lba, n, coalesce_buffer)) {
+        vga_writestr("Cache Error: Write-back failed\n");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        run[i]->dirty = false;
+    }
+    stats.dirty -= n;
+    stats.writebacks++;
+    stats.written += n;
+    return n;
+}
+
+// Write back every dirty sector of dev, or of all devices. Runs start at
+// a dirty sector whose predecessor is not dirty.
+static bool bcache_writeback_all(blockdev_t* dev) {
+    if (stats.dirty && !bcache_run_hook(dev)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < stats.buffers && stats.dirty; i++) {
+        bcache_buf_t* buf = &buffers[i];
+        if (!buf->dirty || (dev && buf->dev != dev)) {
+            continue;
+        }
+
+        // Walk back to the start of the run
+        bcache_buf_t* prev;
+        while (buf->lba > 0 && (prev = bcache_dirty_at(buf->dev, buf->lba - 1))) {
+            buf = prev;
+        }
+        // Runs longer than the staging buffer go out in pieces
+        while (buf) {
+            uint32_t written = bcache_write_run(buf, BCACHE_COALESCE_SECTORS);
+            if (!written) {
+                return false;
+            }
+            buf = bcache_dirty_at(buf->dev, buf->lba + written);
+        }
+    }
+    return true;
+}
+
+// Runs are cut at the end of the range, sectors past it stay dirty
+bool bcache_writeback_range(blockdev_t* dev, uint64_t lba, uint32_t count) {
+    for (uint32_t i = 0; buffers && i < stats.buffers && stats.dirty; i++) {
+        bcache_buf_t* buf = &buffers[i];
+        if (!buf->dirty || buf->dev != dev || buf->lba < lba || buf->lba >= lba + count) {
+            continue;
+        }
+
+        bcache_buf_t* prev;
+        while (buf->lba > lba && (prev = bcache_dirty_at(buf->dev, buf->lba - 1))) {
+            buf = prev;
+        }
+        while (buf && buf->lba < lba + count) {
+            uint32_t written = bcache_write_run(buf, (uint32_t)(lba + count - buf->lba));
+            if (!written) {
+                return false;
+            }
+            buf = bcache_dirty_at(buf->dev, buf->lba + written);
+        }
+    }
+    return true;
+}
+
+void bcache_set_writeback(bool enabled) {
+    if (!enabled) {
+        bcache_sync(NULL);
+    }
+    writeback = enabled;
+}
+
+void bcache_set_writeback_hook(bool (*hook)(blockdev_t* dev)) {
+    writeback_hook = hook;
+}
+
+bool bcache_writeback_enabled(void) {
+    return writeback;
+}
+
+bool bcache_sync(blockdev_t* dev) {
+    bool ok = !buffers || bcache_writeback_all(dev);
+
+    if (dev) {
+        return blockdev_flush(dev) && ok;
+    }
+    for (int i = 0; i < blockdev_count(); i++) {
+        if (!blockdev_flush(blockdev_get_index(i))) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Periodic flusher. Everything goes out once the oldest dirty sector has
+// waited BCACHE_WRITEBACK_MS.
+void bcache_tick(void) {
+    if (stats.dirty && timer_ticks() - oldest_dirty_tick >= BCACHE_WRITEBACK_MS) {
+        bcache_sync(NULL);
+        oldest_dirty_tick = timer_ticks();
+    }
+}
+
+const bcache_stats_t* bcache_get_stats(void) {
+    return &stats;
+}
+
+void bcache_reset_stats(void) {
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+    stats.writebacks = 0;
+    stats.written = 0;
+    stats.prefetched = 0;
+}
@@ -0,0 +1,540 @@
+#include "../include/blockdev.h"
+#include "../include/string.h"
+#include "../include/vga.h"
+#include "../include/timer.h"
+
+static blockdev_t* devices[BLOCKDEV_MAX_DEVICES];
+static int device_count = 0;
+
+// Requests handed out by blockdev_queue_read/write
+static blockdev_request_t request_pool[BLOCKDEV_POOL_SIZE];
+static blockdev_request_t* free_requests = NULL;
+static bool pool_ready = false;
+
+static void blockdev_run_queue(blockdev_t* dev);
+static blockdev_request_t* blockdev_alloc_request(void);
+static void blockdev_free_request(blockdev_request_t* req);
+
+bool blockdev_register(blockdev_t* dev) {
+    if (!dev || !dev->ops || !dev->ops->read || !dev->ops->write) {
+        return false;
+    }
+
+    if (device_count >= BLOCKDEV_MAX_DEVICES) {
+        vga_writestr("Block Error: Too many devices\n");
+        return false;
+    }
+
+    if (blockdev_get(dev->name)) {
+        return false;
+    }
+
+    devices[device_count++] = dev;
+    return true;
+}
+
+blockdev_t* blockdev_get(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) {
+            return devices[i];
+        }
+    }
+    return NULL;
+}
+
+blockdev_t* blockdev_get_index(int index) {
+    if (index < 0 || index >= device_count) {
+        return NULL;
+    }
+    return devices[index];
+}
+
+int blockdev_count(void) {
+    return device_count;
+}
+
+static bool blockdev_check_range(blockdev_t* dev, uint64_t lba, uint32_t count) {
+    if (!dev) {
+        return false;
+    }
+    if (lba + count > dev->sector_count) {
+        vga_writestr("Block Error: Access beyond end of device\n");
+        return false;
+    }
+    return true;
+}
+
+static bool blockdev_overlaps(const blockdev_request_t* req, uint64_t lba, uint32_t count) {
+    return lba < req->lba + req->count && req->lba < lba + count;
+}
+
+// A queued request touching the same sectors, where either side writes
+static bool blockdev_queue_conflicts(blockdev_t* dev, uint8_t op, uint64_t lba, uint32_t count) {
+    for (blockdev_request_t* req = dev->queue; req; req = req->next) {
+        if ((op == BLOCKDEV_OP_WRITE || req->op == BLOCKDEV_OP_WRITE) &&
+            blockdev_overlaps(req, lba, count)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int blockdev_log2(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+// Count one command. Depth is what was in flight when it was issued.
+static void blockdev_account_issue(blockdev_t* dev, uint8_t op, uint32_t count, uint32_t depth) {
+    blockdev_stats_t* stats = &dev->stats;
+    int bucket = blockdev_log2(depth);
+
+    stats->ops[op]++;
+    stats->sectors[op] += count;
+    stats->depth[bucket < BLOCKDEV_DEPTH_BUCKETS ? bucket : BLOCKDEV_DEPTH_BUCKETS - 1]++;
+    if (depth > stats->max_depth) {
+        stats->max_depth = depth;
+    }
+}
+
+static void blockdev_account_done(blockdev_t* dev, uint8_t op, uint64_t issued, bool ok) {
+    int bucket = blockdev_log2(timer_rdtsc() - issued);
+    dev->stats.latency[op][bucket < BLOCKDEV_LAT_BUCKETS ? bucket : BLOCKDEV_LAT_BUCKETS - 1]++;
+    if (!ok) {
+        dev->stats.errors++;
+    }
+}
+
+void blockdev_stats_reset(blockdev_t* dev) {
+    memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+static bool blockdev_execute(blockdev_t* dev, uint8_t op, uint64_t lba, uint32_t count,
+                             void* buffer, uint32_t flags) {
+    if (op > BLOCKDEV_OP_FLUSH) {
+        return false;
+    }
+
+    blockdev_account_issue(dev, op, op == BLOCKDEV_OP_FLUSH ? 0 : count, 1);
+    uint64_t issued = timer_rdtsc();
+
+    bool ok;
+    switch (op) {
+        case BLOCKDEV_OP_READ:
+            ok = dev->ops->read(dev, lba, count, buffer);
+            break;
+        case BLOCKDEV_OP_WRITE:
+            ok = dev->ops->write(dev, lba, count, buffer, flags);
+            break;
+        default:
+            ok = dev->ops->flush ? dev->ops->flush(dev) : true;
+            break;
+    }
+
+    blockdev_account_done(dev, op, issued, ok);
+    return ok;
+}
+
+bool blockdev_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if (!blockdev_check_range(dev, lba, count)) {
+        return false;
+    }
+    if (blockdev_queue_conflicts(dev, BLOCKDEV_OP_READ, lba, count)) {
+        blockdev_run_queue(dev);
+    }
+    // Reads in flight cannot change what this one sees, let them run on
+    if (dev->inflight_writes) {
+        blockdev_drain(dev);
+    }
+    return blockdev_execute(dev, BLOCKDEV_OP_READ, lba, count, buffer, 0);
+}
+
+bool blockdev_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return blockdev_write_flags(dev, lba, count, buffer, 0);
+}
+
+bool blockdev_write_flags(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    if (!blockdev_check_range(dev, lba, count)) {
+        return false;
+    }
+    if (blockdev_queue_conflicts(dev, BLOCKDEV_OP_WRITE, lba, count)) {
+        blockdev_run_queue(dev);
+    }
+    blockdev_drain(dev);
+    return blockdev_execute(dev, BLOCKDEV_OP_WRITE, lba, count, (void*)buffer, flags);
+}
+
+// Devices without a volatile cache leave flush unset. A flush is a
+// barrier, everything queued before it goes out first.
+bool blockdev_flush(blockdev_t* dev) {
+    if (!dev) {
+        return false;
+    }
+    blockdev_run_queue(dev);
+    blockdev_drain(dev);
+    if (!dev->ops->flush) {
+        return true;
+    }
+    return blockdev_execute(dev, BLOCKDEV_OP_FLUSH, 0, 0, NULL, 0);
+}
+
+bool blockdev_can_discard(blockdev_t* dev) {
+    return dev && dev->ops->discard;
+}
+
+uint32_t blockdev_max_sectors(blockdev_t* dev) {
+    if (dev->max_sectors && dev->max_sectors < BLOCKDEV_MAX_MERGE_SECTORS) {
+        return dev->max_sectors;
+    }
+    return BLOCKDEV_MAX_MERGE_SECTORS;
+}
+
+// Ranges go to the driver in one call so it can batch them into as few
+// commands as the device allows. Like a flush, discard is a barrier.
+bool blockdev_discard(blockdev_t* dev, const blockdev_range_t* ranges, uint32_t count) {
+    if (!blockdev_can_discard(dev) || count == 0) {
+        return true;
+    }
+
+    uint32_t sectors = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!blockdev_check_range(dev, ranges[i].lba, ranges[i].count)) {
+            return false;
+        }
+        sectors += ranges[i].count;
+    }
+
+    blockdev_run_queue(dev);
+    blockdev_drain(dev);
+
+    blockdev_account_issue(dev, BLOCKDEV_OP_DISCARD, sectors, 1);
+    uint64_t issued = timer_rdtsc();
+    bool ok = dev->ops->discard(dev, ranges, count);
+    blockdev_account_done(dev, BLOCKDEV_OP_DISCARD, issued, ok);
+    return ok;
+}
+
+// Sorted insert, equal LBAs keep their submission order
+static void blockdev_enqueue(blockdev_t* dev, blockdev_request_t* req) {
+    if (dev->queue_len >= BLOCKDEV_QUEUE_DEPTH ||
+        blockdev_queue_conflicts(dev, req->op, req->lba, req->count)) {
+        blockdev_run_queue(dev);
+    }
+
+    blockdev_request_t** link = &dev->queue;
+    while (*link && (*link)->lba <= req->lba) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+    dev->queue_len++;
+}
+
+static bool blockdev_can_merge(blockdev_t* dev, const blockdev_request_t* prev,
+                               const blockdev_request_t* next, uint32_t sectors) {
+    return prev->op == next->op &&
+           prev->op != BLOCKDEV_OP_FLUSH &&
+           prev->flags == next->flags &&
+           prev->lba + prev->count == next->lba &&
+           (uint8_t*)prev->buffer + prev->count * dev->sector_size == (uint8_t*)next->buffer &&
+           sectors + next->count <= blockdev_max_sectors(dev);
+}
+
+// Hand a request to the driver. Submit drivers complete it later.
+static void blockdev_dispatch(blockdev_t* dev, blockdev_request_t* req) {
+    if (!dev->ops->submit) {
+        bool ok = blockdev_execute(dev, req->op, req->lba, req->count, req->buffer, req->flags);
+        blockdev_complete(req, ok);
+        return;
+    }
+
+    req->dev = dev;
+    dev->inflight++;
+    if (req->op != BLOCKDEV_OP_READ) {
+        dev->inflight_writes++;
+    }
+    blockdev_account_issue(dev, req->op, req->op == BLOCKDEV_OP_FLUSH ? 0 : req->count, dev->inflight);
+    req->issued = timer_rdtsc();
+    dev->ops->submit(dev, req);
+}
+
+// Completes the requests a merged command carried
+static void blockdev_group_done(blockdev_request_t* carrier) {
+    blockdev_request_t* req = carrier->merged;
+    while (req) {
+        blockdev_request_t* next = req->next;
+        blockdev_complete(req, carrier->success);
+        req = next;
+    }
+    blockdev_free_request(carrier);
+}
+
+// Dispatch everything queued in C-LOOK order: sweep upward from the last
+// position, wrap to the lowest LBA once. Neighbours that are adjacent on
+// disk and in memory go out as one command.
+static void blockdev_run_queue(blockdev_t* dev) {
+    blockdev_request_t* order[BLOCKDEV_QUEUE_DEPTH];
+    uint32_t n = 0;
+
+    for (blockdev_request_t* req = dev->queue; req; req = req->next) {
+        order[n++] = req;
+    }
+    dev->queue = NULL;
+    dev->queue_len = 0;
+
+    if (n == 0) {
+        return;
+    }
+
+    // Batches are barriers to each other, submit drivers may reorder
+    // within one
+    blockdev_drain(dev);
+
+    uint32_t start = 0;
+    while (start < n && order[start]->lba < dev->head_lba) {
+        start++;
+    }
+    if (start == n) {
+        start = 0;
+    }
+
+    uint32_t i = 0;
+    while (i < n) {
+        blockdev_request_t* first = order[(start + i) % n];
+        uint32_t group = 1;
+        uint32_t sectors = first->count;
+
+        while (i + group < n) {
+            blockdev_request_t* prev = order[(start + i + group - 1) % n];
+            blockdev_request_t* next = order[(start + i + group) % n];
+            if (!blockdev_can_merge(dev, prev, next, sectors)) {
+                break;
+            }
+            sectors += next->count;
+            group++;
+        }
+
+        dev->head_lba = first->lba + sectors;
+        dev->stats.merges += group - 1;
+
+        if (!dev->ops->submit) {
+            bool ok = blockdev_execute(dev, first->op, first->lba, sectors, first->buffer, first->flags);
+            for (uint32_t j = 0; j < group; j++) {
+                blockdev_complete(order[(start + i + j) % n], ok);
+            }
+            i += group;
+            continue;
+        }
+
+        // One command carries the whole group, its completion fans out
+        blockdev_request_t* carrier = group > 1 ? blockdev_alloc_request() : NULL;
+        if (!carrier) {
+            for (uint32_t j = 0; j < group; j++) {
+                order[(start + i + j) % n]->next = NULL;
+                blockdev_dispatch(dev, order[(start + i + j) % n]);
+            }
+            i += group;
+            continue;
+        }
+
+        for (uint32_t j = 0; j < group; j++) {
+            order[(start + i + j) % n]->next = j + 1 < group ? order[(start + i + j + 1) % n] : NULL;
+        }
+        carrier->op = first->op;
+        carrier->flags = first->flags;
+        carrier->lba = first->lba;
+        carrier->count = sectors;
+        carrier->buffer = first->buffer;
+        carrier->callback = blockdev_group_done;
+        carrier->merged = first;
+        blockdev_dispatch(dev, carrier);
+        i += group;
+    }
+
+    if (dev->ops->commit) {
+        dev->ops->commit(dev);
+    }
+}
+
+void blockdev_plug(blockdev_t* dev) {
+    if (dev->plug_depth++ == 0) {
+        dev->queue_error = false;
+    }
+}
+
+// Returns false if any pool request queued since the plug failed
+bool blockdev_unplug(blockdev_t* dev) {
+    if (dev->plug_depth > 0 && --dev->plug_depth > 0) {
+        return !dev->queue_error;
+    }
+
+    blockdev_run_queue(dev);
+    blockdev_drain(dev);
+
+    bool ok = !dev->queue_error;
+    dev->queue_error = false;
+    return ok;
+}
+
+static blockdev_request_t* blockdev_alloc_request(void) {
+    if (!pool_ready) {
+        for (int i = 0; i < BLOCKDEV_POOL_SIZE; i++) {
+            request_pool[i].next = free_requests;
+            free_requests = &request_pool[i];
+        }
+        pool_ready = true;
+    }
+
+    blockdev_request_t* req = free_requests;
+    if (req) {
+        free_requests = req->next;
+        memset(req, 0, sizeof(*req));
+        req->pooled = true;
+    }
+    return req;
+}
+
+static void blockdev_free_request(blockdev_request_t* req) {
+    req->next = free_requests;
+    free_requests = req;
+}
+
+static void blockdev_pool_done(blockdev_request_t* req) {
+    blockdev_t* dev = (blockdev_t*)req->private_data;
+    if (!req->success) {
+        dev->queue_error = true;
+    }
+    blockdev_free_request(req);
+}
+
+static bool blockdev_queue_request(blockdev_t* dev, uint8_t op, uint64_t lba, uint32_t count,
+                                   void* buffer, uint32_t flags) {
+    if (!blockdev_check_range(dev, lba, count)) {
+        return false;
+    }
+
+    blockdev_request_t* req = blockdev_alloc_request();
+    if (!req) {
+        // Pool exhausted: drain this queue, or fall back to synchronous I/O
+        blockdev_run_queue(dev);
+        blockdev_drain(dev);
+        req = blockdev_alloc_request();
+        if (!req) {
+            return blockdev_execute(dev, op, lba, count, buffer, flags);
+        }
+    }
+
+    req->op = op;
+    req->flags = flags;
+    req->lba = lba;
+    req->count = count;
+    req->buffer = buffer;
+    req->callback = blockdev_pool_done;
+    req->private_data = dev;
+    return blockdev_submit(dev, req);
+}
+
+bool blockdev_queue_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    return blockdev_queue_request(dev, BLOCKDEV_OP_WRITE, lba, count, (void*)buffer, flags);
+}
+
+static bool blockdev_submit_io(blockdev_t* dev, blockdev_request_t* req, uint8_t op, uint64_t lba,
+                               uint32_t count, void* buffer, uint32_t flags,
+                               void (*callback)(blockdev_request_t* req), void* private_data) {
+    memset(req, 0, sizeof(*req));
+    req->op = op;
+    req->flags = flags;
+    req->lba = lba;
+    req->count = count;
+    req->buffer = buffer;
+    req->callback = callback;
+    req->private_data = private_data;
+    return blockdev_submit(dev, req);
+}
+
+bool blockdev_read_async(blockdev_t* dev, blockdev_request_t* req, uint64_t lba, uint32_t count,
+                         void* buffer, void (*callback)(blockdev_request_t* req), void* private_data) {
+    return blockdev_submit_io(dev, req, BLOCKDEV_OP_READ, lba, count, buffer, 0, callback, private_data);
+}
+
+// Plugged devices hold requests back. Otherwise drivers without a submit
+// hook run the request synchronously.
+bool blockdev_submit(blockdev_t* dev, blockdev_request_t* req) {
+    if (!dev || !req) {
+        return false;
+    }
+
+    req->done = false;
+    req->success = false;
+    req->next = NULL;
+
+    // Discards go through blockdev_discard, not the request queue
+    if (req->op > BLOCKDEV_OP_FLUSH ||
+        (req->op != BLOCKDEV_OP_FLUSH && !blockdev_check_range(dev, req->lba, req->count))) {
+        blockdev_complete(req, false);
+        return false;
+    }
+
+    if (dev->plug_depth > 0 && req->op != BLOCKDEV_OP_FLUSH) {
+        blockdev_enqueue(dev, req);
+        return true;
+    }
+
+    // A flush is a barrier for everything queued or in flight before it
+    if (req->op == BLOCKDEV_OP_FLUSH) {
+        blockdev_run_queue(dev);
+        blockdev_drain(dev);
+    }
+
+    blockdev_dispatch(dev, req);
+    if (dev->ops->commit) {
+        dev->ops->commit(dev);
+    }
+    return req->done ? req->success : true;
+}
+
+void blockdev_complete(blockdev_request_t* req, bool success) {
+    if (req->dev) {
+        blockdev_account_done(req->dev, req->op, req->issued, success);
+        req->dev->inflight--;
+        if (req->op != BLOCKDEV_OP_READ) {
+            req->dev->inflight_writes--;
+        }
+        req->dev = NULL;
+    }
+    req->success = success;
+    req->done = true;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+// Submit drivers may only notice completions when polled
+static void blockdev_poll_all(void) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i]->inflight && devices[i]->ops->poll) {
+            devices[i]->ops->poll(devices[i]);
+        }
+    }
+}
+
+bool blockdev_wait(blockdev_request_t* req) {
+    while (!req->done) {
+        blockdev_poll_all();
+        asm volatile("pause");
+    }
+    return req->success;
+}
+
+// Wait for every request handed to the driver to complete
+void blockdev_drain(blockdev_t* dev) {
+    while (dev->inflight) {
+        if (dev->ops->poll) {
+            dev->ops->poll(dev);
+        }
+        asm volatile("pause");
+    }
+}
@@ -2,11 +2,15 @@
 #include "../include/io.h"
 #include "../include/string.h"
 #include "../include/vga.h"
-#include "../include/ata.h"
+#include "../include/blockdev.h"
 #include "../include/stdint.h"
+#include "../include/bcache.h"
+#include "../include/memory.h"
+#include "../include/timer.h"
 
 static bool debug = false;
 static bool is_initialized = false;
+static blockdev_t* fs_dev = NULL;
 static fat32_boot_sector_t boot_sector;
 static uint32_t fat_begin_lba;
 static uint32_t cluster_begin_lba;
@@ -18,6 +22,34 @@ static int directory_depth = 0;
 static fat32_dir_entry_t found_entry;
 static bool file_found = false;
 
+// The FAT, loaded at mount. Changed sectors are tracked in a bitmap and
+// written to every FAT copy at sync points.
+static uint32_t* fat_table = NULL;
+static uint32_t fat_table_sectors = 0;      // Allocated size
+static bool fat_alloc_tried = false;        // Allocated once, kept across mounts
+static bool fat_cached = false;             // Else entries go through bcache
+static uint32_t* fat_dirty = NULL;          // One bit per FAT sector
+static uint32_t fat_dirty_count = 0;
+static uint32_t fat_dirty_tick = 0;         // When the first one was dirtied
+
+// Free clusters, one bit each, built from the FAT at mount. The summary
+// has a bit per bitmap word with any free cluster in it, so allocation
+// skips 1024 full clusters per summary word.
+static uint32_t* free_bitmap = NULL;
+static uint32_t* free_summary = NULL;
+static uint32_t max_cluster;                // Highest valid cluster number
+static uint32_t free_clusters;
+static uint32_t next_free;                  // Rotating allocation cursor
+
+static fat32_fsinfo_t fsinfo __attribute__((aligned(16)));
+static bool fsinfo_present = false;
+static bool fsinfo_dirty = false;
+
+// Freed clusters not yet discarded, coalesced into sector ranges
+static bool discard_enabled = true;
+static blockdev_range_t discard_ranges[FAT32_DISCARD_BATCH];
+static uint32_t discard_count = 0;
+
 static void uint32_to_str(uint32_t num, char* str) {
     char rev[11];
     int i = 0;
@@ -237,13 +269,276 @@ static void update_path(void) {
     }
 }
 
+// Mount the first registered block device
 bool fat32_init(void) {
-    if (!ata_read_sectors(0, 1, &boot_sector)) {
+    return fat32_mount(blockdev_get_index(0));
+}
+
+// Read the whole first FAT into memory. The tables are allocated on the
+// first mount and reused by later ones. When they do not fit, entries
+// are read and written sector by sector through the cache instead.
+static bool fat32_load_fat(void) {
+    uint32_t sectors = boot_sector.fat_size_32;
+
+    if (!fat_alloc_tried) {
+        fat_alloc_tried = true;
+        fat_table = kmalloc_aligned(sectors * 512, 16);
+        if (fat_table) {
+            fat_dirty = kmalloc(((sectors + 31) / 32) * 4);
+            free_bitmap = kmalloc(sectors * 16);
+            free_summary = kmalloc(((sectors * 4 + 31) / 32) * 4);
+        }
+        if (fat_table && fat_dirty && free_bitmap && free_summary) {
+            fat_table_sectors = sectors;
+        }
+    }
+
+    fat_dirty_count = 0;
+    fat_cached = fat_table_sectors >= sectors;
+    if (!fat_cached) {
+        vga_writestr("FAT too large for memory, using the sector cache\n");
+        return true;
+    }
+    memset(fat_dirty, 0, ((sectors + 31) / 32) * 4);
+
+    for (uint32_t sector = 0; sector < sectors; sector += FAT32_FAT_IO_SECTORS) {
+        uint32_t count = sectors - sector;
+        if (count > FAT32_FAT_IO_SECTORS) {
+            count = FAT32_FAT_IO_SECTORS;
+        }
+        if (!blockdev_read(fs_dev, fat_begin_lba + sector, count, (uint8_t*)fat_table + sector * 512)) {
+            vga_writestr("Error: Failed to read FAT\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fat32_set_free(uint32_t cluster, bool free) {
+    uint32_t word = cluster / 32;
+    uint32_t bit = 1u << (cluster % 32);
+
+    if (free) {
+        free_bitmap[word] |= bit;
+        free_summary[word / 32] |= 1u << (word % 32);
+    } else {
+        free_bitmap[word] &= ~bit;
+        if (!free_bitmap[word]) {
+            free_summary[word / 32] &= ~(1u << (word % 32));
+        }
+    }
+}
+
+// Entry access when the FAT is not held in memory
+static bool fat32_read_entry(uint32_t cluster, uint32_t* value) {
+    bcache_buf_t* buf = bcache_get(fs_dev, fat_begin_lba + cluster / 128);
+    if (!buf) {
+        vga_writestr("Error: Failed to read FAT\n");
+        return false;
+    }
+    *value = ((uint32_t*)buf->data)[cluster % 128];
+    bcache_put(buf);
+    return true;
+}
+
+static bool fat32_write_entry(uint32_t cluster, uint32_t value) {
+    uint32_t sector = cluster / 128;
+    uint32_t entries[128];
+
+    for (uint32_t fat = 0; fat < boot_sector.num_fats; fat++) {
+        uint32_t lba = fat_begin_lba + fat * boot_sector.fat_size_32 + sector;
+        if (!bcache_read(fs_dev, lba, entries)) {
+            vga_writestr("Error: Failed to read FAT\n");
+            return false;
+        }
+        entries[cluster % 128] = (entries[cluster % 128] & 0xF0000000) | (value & 0x0FFFFFFF);
+        if (!bcache_write(fs_dev, lba, entries, 0)) {
+            vga_writestr("Error: Failed to write FAT\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Count free clusters one cached FAT sector at a time
+static void fat32_count_free(void) {
+    free_clusters = 0;
+    for (uint32_t sector = 0; sector <= max_cluster / 128; sector++) {
+        bcache_buf_t* buf = bcache_get(fs_dev, fat_begin_lba + sector);
+        if (!buf) {
+            vga_writestr("Error: Failed to read FAT\n");
+            return;
+        }
+        const uint32_t* entries = (const uint32_t*)buf->data;
+        for (uint32_t i = 0; i < 128; i++) {
+            uint32_t cluster = sector * 128 + i;
+            if (cluster >= 2 && cluster <= max_cluster && (entries[i] & 0x0FFFFFFF) == 0) {
+                free_clusters++;
+            }
+        }
+        bcache_put(buf);
+    }
+}
+
+// Build the free bitmap from the FAT, and take the next-free hint from
+// FSInfo when it has a valid one
+static void fat32_load_free_map(void) {
+    uint32_t sectors = boot_sector.fat_size_32;
+    uint32_t clusters = (boot_sector.total_sectors_32 - cluster_begin_lba) / sectors_per_cluster;
+
+    max_cluster = clusters + 1;
+    if (max_cluster >= sectors * 128) {
+        max_cluster = sectors * 128 - 1;
+    }
+
+    if (fat_cached) {
+        memset(free_bitmap, 0, sectors * 16);
+        memset(free_summary, 0, ((sectors * 4 + 31) / 32) * 4);
+        free_clusters = 0;
+        for (uint32_t cluster = 2; cluster <= max_cluster; cluster++) {
+            if ((fat_table[cluster] & 0x0FFFFFFF) == 0) {
+                fat32_set_free(cluster, true);
+                free_clusters++;
+            }
+        }
+    } else {
+        fat32_count_free();
+    }
+
+    next_free = 2;
+    fsinfo_present = false;
+    fsinfo_dirty = false;
+    if (boot_sector.fs_info == 0 || boot_sector.fs_info >= boot_sector.reserved_sectors) {
+        return;
+    }
+
+    fsinfo_present = true;
+    if (blockdev_read(fs_dev, boot_sector.fs_info, 1, &fsinfo) &&
+        fsinfo.lead_signature == FAT32_FSINFO_LEAD_SIG &&
+        fsinfo.struct_signature == FAT32_FSINFO_STRUCT_SIG &&
+        fsinfo.trail_signature == FAT32_FSINFO_TRAIL_SIG) {
+        if (fsinfo.next_free >= 2 && fsinfo.next_free <= max_cluster) {
+            next_free = fsinfo.next_free;
+        }
+        // The count is rebuilt from the FAT, fix it if it went stale
+        fsinfo_dirty = fsinfo.free_count != free_clusters;
+    } else {
+        // Missing or corrupt, written fresh at the next sync
+        memset(&fsinfo, 0, sizeof(fsinfo));
+        fsinfo.lead_signature = FAT32_FSINFO_LEAD_SIG;
+        fsinfo.struct_signature = FAT32_FSINFO_STRUCT_SIG;
+        fsinfo.trail_signature = FAT32_FSINFO_TRAIL_SIG;
+        fsinfo_dirty = true;
+    }
+}
+
+static bool fat32_flush_fsinfo(void) {
+    if (!fsinfo_present || !fsinfo_dirty) {
+        return true;
+    }
+    fsinfo.free_count = free_clusters;
+    fsinfo.next_free = next_free;
+    if (!blockdev_write(fs_dev, boot_sector.fs_info, 1, &fsinfo)) {
+        vga_writestr("Error: Failed to write FSInfo\n");
+        return false;
+    }
+    fsinfo_dirty = false;
+    return true;
+}
+
+static bool fat32_fat_dirty(uint32_t sector) {
+    return fat_dirty[sector / 32] & (1u << (sector % 32));
+}
+
+static void fat32_mark_fat_dirty(uint32_t sector) {
+    if (fat32_fat_dirty(sector)) {
+        return;
+    }
+    if (fat_dirty_count == 0) {
+        fat_dirty_tick = timer_ticks();
+    }
+    fat_dirty[sector / 32] |= 1u << (sector % 32);
+    fat_dirty_count++;
+}
+
+// Write dirty FAT sectors to every copy, one command per run of
+// adjacent sectors and copy. Uncached, they are dirty in bcache instead.
+static bool fat32_flush_fat_sectors(void) {
+    uint32_t sector = 0;
+
+    if (!fat_cached) {
+        return bcache_writeback_range(fs_dev, fat_begin_lba,
+                                      boot_sector.num_fats * boot_sector.fat_size_32);
+    }
+    while (fat_dirty_count > 0 && sector < boot_sector.fat_size_32) {
+        if (!fat_dirty[sector / 32]) {
+            sector = (sector + 32) & ~31u;
+            continue;
+        }
+        if (!fat32_fat_dirty(sector)) {
+            sector++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (run < FAT32_FAT_IO_SECTORS && sector + run < boot_sector.fat_size_32 &&
+               fat32_fat_dirty(sector + run)) {
+            run++;
+        }
+
+        const uint8_t* data = (const uint8_t*)fat_table + sector * 512;
+        for (uint32_t fat = 0; fat < boot_sector.num_fats; fat++) {
+            uint32_t lba = fat_begin_lba + fat * boot_sector.fat_size_32 + sector;
+            if (!blockdev_write(fs_dev, lba, run, data)) {
+                vga_writestr("Error: Failed to write FAT\n");
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < run; i++, sector++) {
+            fat_dirty[sector / 32] &= ~(1u << (sector % 32));
+        }
+        fat_dirty_count -= run;
+    }
+    return true;
+}
+
+static bool fat32_flush_fat(void) {
+    return fat32_flush_fat_sectors() && fat32_flush_fsinfo();
+}
+
+// The cache is about to write sectors of dev. Directory sectors may point
+// at clusters only the in-memory FAT has linked yet, so it goes first.
+static bool fat32_writeback_hook(blockdev_t* dev) {
+    if (!is_initialized || (dev && dev != fs_dev) || (fat_cached && fat_dirty_count == 0)) {
+        return true;
+    }
+    return fat32_flush_fat_sectors();
+}
+
+bool fat32_mount(blockdev_t* dev) {
+    if (!dev) {
+        vga_writestr("Error: No block device to mount\n");
+        return false;
+    }
+
+    // Changes to the volume mounted before must not be lost
+    if (is_initialized && (fat_dirty_count > 0 || !fat_cached)) {
+        fat32_sync();
+    }
+
+    is_initialized = false;
+    fs_dev = dev;
+
+    // The boot sector struct is shorter than the sector it is read from
+    uint8_t sector[512];
+    if (!blockdev_read(fs_dev, 0, 1, sector)) {
         vga_writestr("Error: Failed to initialize filesystem\n");
         return false;
     }
+    memcpy(&boot_sector, sector, sizeof(boot_sector));
 
-    if (boot_sector.bytes_per_sector != 512) {
+    if (boot_sector.bytes_per_sector != 512 || dev->sector_size != 512) {
         vga_writestr("Error: Invalid filesystem\n");
         return false;
     }
@@ -252,11 +547,17 @@ bool fat32_init(void) {
     sectors_per_cluster = boot_sector.sectors_per_cluster;
     cluster_begin_lba = fat_begin_lba + (boot_sector.num_fats * boot_sector.fat_size_32);
 
+    if (!fat32_load_fat()) {
+        return false;
+    }
+    fat32_load_free_map();
+
     current_directory.cluster = boot_sector.root_cluster;
     strcpy(current_directory.name, "/");
     strcpy(current_directory.path, "/");
     directory_depth = 0;
 
+    bcache_set_writeback_hook(fat32_writeback_hook);
     is_initialized = true;
     return true;
 }
@@ -274,16 +575,138 @@ static uint32_t cluster_to_lba(uint32_t cluster) {
     return cluster_begin_lba + ((cluster - 2) * sectors_per_cluster);
 }
 
-uint32_t fat32_get_next_cluster(uint32_t cluster) {
-    uint32_t fat_sector = fat_begin_lba + ((cluster * 4) / 512);
-    uint32_t offset = (cluster * 4) % 512;
-    uint32_t buffer[128];
+// First sector of a directory cluster. The whole cluster comes into the
+// cache with one command, the scan reads it sector by sector.
+static uint32_t fat32_dir_sector(uint32_t cluster) {
+    uint32_t lba = cluster_to_lba(cluster);
+    bcache_readahead(fs_dev, lba, sectors_per_cluster);
+    return lba;
+}
 
-    if (!ata_read_sectors(fat_sector, 1, buffer)) {
+// Clusters past the end of the FAT read as bad
+uint32_t fat32_get_next_cluster(uint32_t cluster) {
+    if (cluster >= boot_sector.fat_size_32 * 128) {
         return 0x0FFFFFF7;
     }
+    if (!fat_cached) {
+        uint32_t value;
+        return fat32_read_entry(cluster, &value) ? value & 0x0FFFFFFF : 0x0FFFFFF7;
+    }
+    return fat_table[cluster] & 0x0FFFFFFF;
+}
+
+// Extent maps of recently read files, keyed by first cluster. Built
+// lazily from the FAT as reads reach further into the file.
+static fat32_extent_map_t extent_maps[FAT32_EXTENT_MAPS];
+static uint32_t extent_clock = 0;
+
+// Files opened with fat32_open, each with its own extent map
+static fat32_file_t* open_files = NULL;
+
+// The extent after prev, or the one starting at first when prev is NULL.
+// False at the end of the chain.
+static bool fat32_next_extent(uint32_t first, const fat32_extent_t* prev, fat32_extent_t* out) {
+    uint32_t start = first;
+    out->file_cluster = 0;
+    if (prev) {
+        start = fat32_get_next_cluster(prev->cluster + prev->count - 1);
+        out->file_cluster = prev->file_cluster + prev->count;
+    }
+    if (start < 2 || start >= 0x0FFFFFF7) {
+        return false;
+    }
+
+    out->cluster = start;
+    out->count = 1;
+    while (fat32_get_next_cluster(start + out->count - 1) == start + out->count) {
+        out->count++;
+    }
+    return true;
+}
+
+static fat32_extent_map_t* fat32_extent_map(uint32_t first_cluster) {
+    fat32_extent_map_t* victim = &extent_maps[0];
+
+    for (int i = 0; i < FAT32_EXTENT_MAPS; i++) {
+        fat32_extent_map_t* map = &extent_maps[i];
+        if (map->first_cluster == first_cluster) {
+            map->last_used = ++extent_clock;
+            return map;
+        }
+        if (map->last_used < victim->last_used) {
+            victim = map;
+        }
+    }
+
+    victim->first_cluster = first_cluster;
+    victim->count = 0;
+    victim->complete = false;
+    victim->last_used = ++extent_clock;
+    return victim;
+}
+
+// Forget the maps of a chain that is being freed or rewritten, open
+// files rebuild theirs on the next access
+static void fat32_extent_forget(uint32_t first_cluster) {
+    for (int i = 0; i < FAT32_EXTENT_MAPS; i++) {
+        if (extent_maps[i].first_cluster == first_cluster) {
+            extent_maps[i].first_cluster = 0;
+            extent_maps[i].last_used = 0;
+        }
+    }
+    for (fat32_file_t* file = open_files; file; file = file->next) {
+        if (file->map.first_cluster == first_cluster) {
+            file->map.count = 0;
+            file->map.complete = false;
+        }
+    }
+}
+
+// The extent holding cluster index within the file. Mapped extents are
+// binary searched, a full map walks on from its last extent.
+static bool fat32_extent_lookup(fat32_extent_map_t* map, uint32_t index, fat32_extent_t* out) {
+    while (!map->complete && map->count < FAT32_EXTENT_MAX &&
+           (map->count == 0 || map->extents[map->count - 1].file_cluster +
+                               map->extents[map->count - 1].count <= index)) {
+        const fat32_extent_t* prev = map->count ? &map->extents[map->count - 1] : NULL;
+        if (!fat32_next_extent(map->first_cluster, prev, &map->extents[map->count])) {
+            map->complete = true;
+            break;
+        }
+        map->count++;
+    }
+    if (map->count == 0) {
+        return false;
+    }
 
-    return buffer[offset/4] & 0x0FFFFFFF;
+    const fat32_extent_t* last = &map->extents[map->count - 1];
+    if (index >= last->file_cluster + last->count) {
+        if (map->complete) {
+            return false;
+        }
+        *out = *last;
+        while (index >= out->file_cluster + out->count) {
+            fat32_extent_t next;
+            if (!fat32_next_extent(map->first_cluster, out, &next)) {
+                return false;
+            }
+            *out = next;
+        }
+        return true;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = map->count - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (map->extents[mid].file_cluster <= index) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    *out = map->extents[lo];
+    return true;
 }
 
 bool fat32_change_directory(const char* dirname) {
@@ -348,10 +771,10 @@ bool fat32_change_directory(const char* dirname) {
     fat32_dir_entry_t* entry;
 
     while (current_cluster < 0x0FFFFFF8) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
                 return false;
             }
 
@@ -409,10 +832,10 @@ bool fat32_list_directory(void (*callback)(const char* name, uint32_t size, uint
     fat32_dir_entry_t* entry;
 
     while (current_cluster < 0x0FFFFFF8) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
                 return false;
             }
 
@@ -455,10 +878,10 @@ bool fat32_create_file(const char* name) {
     fat32_dir_entry_t* entry;
 
     while (current_cluster < 0x0FFFFFF8) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
                 return false;
             }
 
@@ -470,7 +893,8 @@ bool fat32_create_file(const char* name) {
                     entry[j].attributes = 0x20;
                     entry[j].file_size = 0;
 
-                    if (!ata_write_sectors(current_sector + i, 1, buffer)) {
+                    // Directory entries must be durable right away
+                    if (!bcache_write(fs_dev, current_sector + i, buffer, BLOCKDEV_WRITE_FUA)) {
                         return false;
                     }
                     return true;
@@ -490,10 +914,10 @@ bool fat32_delete_file(const char* name) {
     fat32_dir_entry_t* entry;
 
     while (current_cluster < 0x0FFFFFF8) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
                 return false;
             }
 
@@ -501,11 +925,31 @@ bool fat32_delete_file(const char* name) {
             for (uint32_t j = 0; j < 16; j++) {
                 if (entry[j].name[0] != 0x00 && entry[j].name[0] != 0xE5) {
                     if (memcmp(entry[j].name, name, 11) == 0) {
+                        uint32_t first_cluster = ((uint32_t)entry[j].first_cluster_high << 16) |
+                                                 entry[j].first_cluster_low;
+                        bool directory = entry[j].attributes & ATTR_DIRECTORY;
+
+                        // Open handles would keep writing to the freed chain
+                        // and bring the entry back
+                        for (fat32_file_t* file = open_files; file; file = file->next) {
+                            if (file->entry_sector == current_sector + i && file->entry_index == j) {
+                                vga_writestr("Error: File is open\n");
+                                return false;
+                            }
+                        }
+
                         entry[j].name[0] = 0xE5;
-                        if (!ata_write_sectors(current_sector + i, 1, buffer)) {
+                        if (!bcache_write(fs_dev, current_sector + i, buffer, BLOCKDEV_WRITE_FUA)) {
+                            return false;
+                        }
+
+                        // Only once nothing points at the chain can it be freed
+                        // and discarded. Directories keep theirs, their entries
+                        // may still point into it.
+                        if (!directory && first_cluster >= 2 && !fat32_free_clusters(first_cluster)) {
                             return false;
                         }
-                        return true;
+                        return bcache_writeback_enabled() || fat32_flush_fat();
                     }
                 }
             }
@@ -523,10 +967,10 @@ bool fat32_create_directory(const char* name) {
     fat32_dir_entry_t* entry;
 
     while (current_cluster < 0x0FFFFFF8) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
                 return false;
             }
 
@@ -538,7 +982,7 @@ bool fat32_create_directory(const char* name) {
                     entry[j].attributes = ATTR_DIRECTORY;
                     entry[j].file_size = 0;
 
-                    if (!ata_write_sectors(current_sector + i, 1, buffer)) {
+                    if (!bcache_write(fs_dev, current_sector + i, buffer, BLOCKDEV_WRITE_FUA)) {
                         return false;
                     }
                     return true;
@@ -550,6 +994,47 @@ bool fat32_create_directory(const char* name) {
     return false;
 }
 
+void fat32_set_discard(bool enabled) {
+    discard_enabled = enabled;
+}
+
+// Send the pending ranges as one batch. Discard is only a hint, a device
+// refusing it leaves the clusters free all the same.
+static void fat32_discard_flush(void) {
+    if (discard_count > 0) {
+        // The cleared FAT entries must be on the medium before the data goes
+        if (!fat32_flush_fat() || !blockdev_flush(fs_dev)) {
+            discard_count = 0;
+            return;
+        }
+        blockdev_discard(fs_dev, discard_ranges, discard_count);
+        discard_count = 0;
+    }
+}
+
+static void fat32_discard_cluster(uint32_t cluster) {
+    if (!discard_enabled || !blockdev_can_discard(fs_dev)) {
+        return;
+    }
+
+    uint64_t lba = cluster_to_lba(cluster);
+    if (discard_count > 0) {
+        blockdev_range_t* last = &discard_ranges[discard_count - 1];
+        if (last->lba + last->count == lba) {
+            last->count += sectors_per_cluster;
+            return;
+        }
+    }
+
+    if (discard_count == FAT32_DISCARD_BATCH) {
+        fat32_discard_flush();
+    }
+    discard_ranges[discard_count].lba = lba;
+    discard_ranges[discard_count].count = sectors_per_cluster;
+    discard_count++;
+}
+
+// The chain's FAT entries are cleared before its sectors are discarded
 bool fat32_free_clusters(uint32_t first_cluster) {
     if (first_cluster < 2 || first_cluster >= 0x0FFFFFF8) {
         return false; // Invalid cluster
@@ -558,6 +1043,7 @@ bool fat32_free_clusters(uint32_t first_cluster) {
     uint32_t current_cluster = first_cluster;
     uint32_t next_cluster;
 
+    fat32_extent_forget(first_cluster);
     while (current_cluster < 0x0FFFFFF8) {
         // Get the next cluster in the chain
         next_cluster = fat32_get_next_cluster(current_cluster);
@@ -567,180 +1053,698 @@ bool fat32_free_clusters(uint32_t first_cluster) {
 
         // Mark the current cluster as free
         if (!fat32_write_fat_entry(current_cluster, 0)) {
+            fat32_discard_flush();
             return false; // Write error
         }
+        // Freed directory clusters may still sit in the cache, dirty
+        bcache_invalidate(fs_dev, cluster_to_lba(current_cluster), sectors_per_cluster);
+        fat32_discard_cluster(current_cluster);
 
         current_cluster = next_cluster;
     }
 
+    fat32_discard_flush();
     return true;
 }
 
-uint32_t fat32_allocate_cluster(void) {
-    uint32_t buffer[128];  // 512 bytes / 4 bytes per entry
+// First free cluster from the given one on, wrapping around once
+static uint32_t fat32_find_free(uint32_t from) {
+    // Without the bitmap, a linear scan of the FAT
+    if (!fat_cached) {
+        uint32_t cluster = from;
+        for (uint32_t scanned = 0; scanned < max_cluster - 1; scanned++, cluster++) {
+            if (cluster < 2 || cluster > max_cluster) {
+                cluster = 2;
+            }
+            if (fat32_get_next_cluster(cluster) == 0) {
+                return cluster;
+            }
+        }
+        return 0;
+    }
+
+    uint32_t words = max_cluster / 32 + 1;
+    uint32_t word = from / 32;
 
-    // Search FAT for a free cluster
-    for (uint32_t fat_sector = 0; fat_sector < boot_sector.fat_size_32; fat_sector++) {
-        if (!ata_read_sectors(fat_begin_lba + fat_sector, 1, buffer)) {
-            return 0;
+    // Summary skips may overshoot the end, allow a few words of slack
+    for (uint32_t scanned = 0; scanned <= words + 32; ) {
+        if (word >= words) {
+            word = 0;
         }
 
-        for (uint32_t i = 0; i < 128; i++) {
-            if (buffer[i] == 0) {
-                // Found a free cluster
-                uint32_t cluster = fat_sector * 128 + i;
-                if (cluster >= 2) {  // Clusters 0 and 1 are reserved
-                    // Mark cluster as end of chain
-                    if (fat32_write_fat_entry(cluster, 0x0FFFFFF8)) {
-                        return cluster;
-                    }
-                }
+        // Skip 32 full words at a time through the summary
+        if (!(free_summary[word / 32] >> (word % 32))) {
+            scanned += 32 - word % 32;
+            word = (word | 31) + 1;
+            continue;
+        }
+
+        uint32_t bits = free_bitmap[word];
+        if (word == from / 32 && scanned == 0) {
+            bits &= ~0u << (from % 32);     // Only from the start on
+        }
+        if (bits) {
+            uint32_t cluster = word * 32 + __builtin_ctz(bits);
+            if (cluster >= 2 && cluster <= max_cluster) {
+                return cluster;
             }
         }
+        word++;
+        scanned++;
     }
-    return 0;  // No free clusters
+    return 0;
 }
 
+uint32_t fat32_allocate_cluster(void) {
+    if (free_clusters == 0) {
+        return 0;  // No free clusters
+    }
+
+    uint32_t cluster = fat32_find_free(next_free);
+    if (!cluster) {
+        return 0;
+    }
+
+    // Mark cluster as end of chain
+    if (!fat32_write_fat_entry(cluster, 0x0FFFFFF8)) {
+        return 0;
+    }
+    next_free = cluster + 1 <= max_cluster ? cluster + 1 : 2;
+    return cluster;
+}
+
+static bool fat32_is_free(uint32_t cluster) {
+    if (!fat_cached) {
+        return fat32_get_next_cluster(cluster) == 0;
+    }
+    return free_bitmap[cluster / 32] & (1u << (cluster % 32));
+}
+
+// Reserve up to want contiguous clusters, linked into a chain ending in
+// an end-of-chain marker. Takes the first free run from the cursor that
+// is long enough, or the longest of the first FAT32_EXTENT_TRIES runs.
+// Returns the first cluster and sets count, 0 when the volume is full.
+static uint32_t fat32_allocate_run(uint32_t want, uint32_t* count) {
+    uint32_t best = 0;
+    uint32_t best_len = 0;
+    uint32_t from = next_free;
+
+    if (free_clusters == 0) {
+        return 0;
+    }
+    if (want > free_clusters) {
+        want = free_clusters;
+    }
+
+    for (int tries = 0; tries < FAT32_EXTENT_TRIES && best_len < want; tries++) {
+        uint32_t start = fat32_find_free(from);
+        if (!start) {
+            break;
+        }
+
+        uint32_t len = 1;
+        while (len < want && start + len <= max_cluster && fat32_is_free(start + len)) {
+            len++;
+        }
+        if (len > best_len) {
+            best = start;
+            best_len = len;
+        }
+
+        from = start + len <= max_cluster ? start + len : 2;
+    }
+    if (!best) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < best_len; i++) {
+        uint32_t next = i + 1 < best_len ? best + i + 1 : 0x0FFFFFFF;
+        fat32_write_fat_entry(best + i, next);
+    }
+    next_free = best + best_len <= max_cluster ? best + best_len : 2;
+    *count = best_len;
+    return best;
+}
+
+// Only the in-memory FAT changes, the copies on disk follow at the next
+// sync point. Uncached, every copy is written through bcache. The top
+// four bits are reserved and kept.
 bool fat32_write_fat_entry(uint32_t cluster, uint32_t value) {
-    uint32_t fat_sector = fat_begin_lba + ((cluster * 4) / 512);
-    uint32_t offset = (cluster * 4) % 512;
-    uint32_t buffer[128];
+    uint32_t old;
 
-    if (!ata_read_sectors(fat_sector, 1, buffer)) {
+    if (cluster < 2 || cluster > max_cluster) {
+        return false;
+    }
+    if (fat_cached) {
+        old = fat_table[cluster];
+    } else if (!fat32_read_entry(cluster, &old) || !fat32_write_entry(cluster, value)) {
         return false;
     }
 
-    buffer[offset/4] = value;
-
-    // Write to all FATs
-    for (uint32_t fat = 0; fat < boot_sector.num_fats; fat++) {
-        uint32_t current_fat_sector = fat_sector + (fat * boot_sector.fat_size_32);
-        if (!ata_write_sectors(current_fat_sector, 1, buffer)) {
-            return false;
+    bool was_free = (old & 0x0FFFFFFF) == 0;
+    bool is_free = (value & 0x0FFFFFFF) == 0;
+    if (was_free != is_free) {
+        if (fat_cached) {
+            fat32_set_free(cluster, is_free);
+        }
+        if (is_free) {
+            free_clusters++;
+        } else {
+            free_clusters--;
         }
+        fsinfo_dirty = true;
     }
 
+    if (fat_cached) {
+        fat_table[cluster] = (old & 0xF0000000) | (value & 0x0FFFFFFF);
+        fat32_mark_fat_dirty(cluster / 128);
+    }
     return true;
 }
 
-bool fat32_write_file(const char* name, const void* data, uint32_t size) {
-    if (!is_initialized || !data) return false;
+// The FAT goes out before the directory sectors that point into it
+bool fat32_sync(void) {
+    if (!fs_dev) {
+        return false;
+    }
+    bool ok = fat32_flush_fat();
+    return bcache_sync(fs_dev) && ok;
+}
 
-    // First, locate or create the file entry
-    uint32_t current_cluster = current_directory.cluster;
-    uint8_t dir_buffer[512];
-    fat32_dir_entry_t* entry = NULL;
-    uint32_t entry_sector = 0;
-    uint32_t entry_offset = 0;
-    bool found_slot = false;
+// Periodic flusher for the FAT, alongside bcache_tick
+void fat32_tick(void) {
+    if (fat_dirty_count > 0 && timer_ticks() - fat_dirty_tick >= BCACHE_WRITEBACK_MS) {
+        fat32_sync();
+        fat_dirty_tick = timer_ticks();
+    }
+}
+
+// One read in flight. Whole sectors land in the caller's buffer, a
+// partial sector at either end goes through the slot's bounce buffer.
+typedef struct {
+    blockdev_request_t req;
+    uint8_t* dest;          // Copy target for bounced reads, else NULL
+    uint32_t skip;          // Offset of the data within the bounce buffer
+    uint32_t bytes;
+} fat32_readahead_t;
+
+static uint8_t bounce_buffers[FAT32_READAHEAD_REQS][512] __attribute__((aligned(16)));
 
-    // Convert the file name to FAT-compliant 8.3 format
-    char fat_name[11] = {0};
-    if (!fat32_convert_to_fat_name(name, fat_name)) {
-        return false; // Conversion failed (invalid name)
+// Clusters per request, grown while files stay contiguous on disk
+static uint32_t readahead_window = FAT32_READAHEAD_MIN;
+
+static bool fat32_readahead_issue(fat32_readahead_t* ra, uint32_t slot, uint32_t lba, uint8_t* dest,
+                                  uint32_t skip, uint32_t bytes) {
+    if (debug) {
+        vga_writestr("[FAT32] Reading sector 0x");
+        for (int i = 7; i >= 0; i--) {
+            char hex = "0123456789ABCDEF"[(lba >> (i * 4)) & 0xF];
+            char str[2] = {hex, 0};
+            vga_writestr(str);
+        }
+        vga_writestr("\n");
     }
 
-    // Search for the file in the directory or find a free entry
-    while (current_cluster < 0x0FFFFFF8 && !found_slot) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+    ra->bytes = bytes;
+    ra->skip = skip;
+    ra->dest = NULL;
+    if (skip || bytes < 512) {
+        ra->dest = dest;
+        dest = bounce_buffers[slot];
+    }
+    return blockdev_read_async(fs_dev, &ra->req, lba, (skip + bytes + 511) / 512, dest, NULL, NULL);
+}
 
-        for (uint32_t i = 0; i < sectors_per_cluster && !found_slot; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, dir_buffer)) {
-                return false;
+// Read length bytes at offset from the file map describes.
+// Each extent is read with as few requests as the read-ahead window
+// allows, up to FAT32_READAHEAD_REQS in flight. A chain shorter than
+// the file ends the read early, *read says how far it got.
+static bool fat32_read_extents(fat32_extent_map_t* map, uint32_t offset, uint8_t* buffer,
+                               uint32_t length, uint32_t* read) {
+    uint32_t cluster_bytes = sectors_per_cluster * 512;
+    fat32_readahead_t ring[FAT32_READAHEAD_REQS];
+    uint32_t head = 0;
+    uint32_t in_flight = 0;
+    uint32_t issued = 0;
+    uint32_t bytes_read = 0;
+    bool chain_ok = true;
+    bool ok = true;
+
+    *read = 0;
+    while (bytes_read < length) {
+        while (ok && chain_ok && in_flight < FAT32_READAHEAD_REQS && issued < length) {
+            uint32_t pos = offset + issued;
+            fat32_extent_t extent;
+            if (!fat32_extent_lookup(map, pos / cluster_bytes, &extent)) {
+                chain_ok = false;
+                break;
             }
 
-            entry = (fat32_dir_entry_t*)dir_buffer;
-            for (uint32_t j = 0; j < 16; j++) {
-                // Check if file already exists
-                if (memcmp(entry[j].name, fat_name, 11) == 0) {
-                    entry = &entry[j];
-                    entry_sector = current_sector + i;
-                    entry_offset = j;
-                    found_slot = true;
-
-                    // Free existing cluster chain before overwriting
-                    uint32_t first_cluster = ((uint32_t)entry->first_cluster_high << 16) | entry->first_cluster_low;
-                    if (!fat32_free_clusters(first_cluster)) return false;
+            uint32_t extent_end = (extent.file_cluster + extent.count) * cluster_bytes;
+            uint32_t lba = cluster_to_lba(extent.cluster) +
+                           (pos - extent.file_cluster * cluster_bytes) / 512;
+            uint32_t skip = pos % 512;
+            uint32_t bytes = length - issued;
 
-                    break;
+            if (skip || bytes < 512) {
+                // Partial sector at the start or end of the range
+                if (bytes > 512 - skip) {
+                    bytes = 512 - skip;
                 }
-
-                // Check for a free slot
-                if (entry[j].name[0] == 0x00 || entry[j].name[0] == 0xE5) {
-                    entry = &entry[j];
-                    entry_sector = current_sector + i;
-                    entry_offset = j;
-                    found_slot = true;
-                    break;
+            } else {
+                // Sequential hit: the window fits inside the extent and
+                // the file goes on. A fragment break halves it again.
+                uint32_t window = readahead_window * cluster_bytes;
+                uint32_t avail = extent_end - pos;
+                if (avail > window) {
+                    avail = window;
+                    if (pos + avail < offset + length && readahead_window < FAT32_READAHEAD_MAX) {
+                        readahead_window *= 2;
+                    }
+                } else if (pos + avail < offset + length && readahead_window > FAT32_READAHEAD_MIN) {
+                    readahead_window /= 2;
+                }
+                if (bytes > avail) {
+                    bytes = avail;
+                }
+                if (bytes > blockdev_max_sectors(fs_dev) * 512) {
+                    bytes = blockdev_max_sectors(fs_dev) * 512;
                 }
+                bytes &= ~511u;
             }
+
+            uint32_t slot = (head + in_flight) % FAT32_READAHEAD_REQS;
+            in_flight++;
+            ok = fat32_readahead_issue(&ring[slot], slot, lba, buffer + issued, skip, bytes);
+            issued += bytes;
         }
 
-        if (!found_slot) {
-            current_cluster = fat32_get_next_cluster(current_cluster);
+        if (in_flight == 0) {
+            break;
         }
+
+        // Every request must finish before returning, even after an error
+        fat32_readahead_t* ra = &ring[head];
+        if (!blockdev_wait(&ra->req)) {
+            ok = false;
+        } else if (ra->dest) {
+            memcpy(ra->dest, bounce_buffers[head] + ra->skip, ra->bytes);
+        }
+        bytes_read += ra->bytes;
+        head = (head + 1) % FAT32_READAHEAD_REQS;
+        in_flight--;
     }
 
-    if (!found_slot) return false;
+    *read = ok ? bytes_read : 0;
+    return ok;
+}
+
+bool fat32_read_range(uint32_t first_cluster, uint32_t file_size, uint32_t offset,
+                      void* buffer, uint32_t* length) {
+    if (!is_initialized || !buffer || !length) {
+        return false;
+    }
+    if (offset >= file_size) {
+        *length = 0;
+        return true;
+    }
+    if (*length > file_size - offset) {
+        *length = file_size - offset;
+    }
+    return fat32_read_extents(fat32_extent_map(first_cluster), offset, buffer, *length, length);
+}
+
+// Look a FAT name up in the current directory, noting where its entry is
+static bool fat32_lookup(const char* fat_name, fat32_file_t* file) {
+    uint32_t current_cluster = current_directory.cluster;
+    uint8_t buffer[512];
+
+    while (current_cluster >= 2 && current_cluster < 0x0FFFFFF8) {
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
+
+        for (uint32_t i = 0; i < sectors_per_cluster; i++) {
+            if (!bcache_read(fs_dev, current_sector + i, buffer)) {
+                return false;
+            }
+
+            fat32_dir_entry_t* entry = (fat32_dir_entry_t*)buffer;
+            for (uint32_t j = 0; j < 16; j++) {
+                if (entry[j].name[0] == 0x00) {
+                    return false;   // End of directory
+                }
+                if (entry[j].name[0] != 0xE5 && memcmp(entry[j].name, fat_name, 11) == 0) {
+                    file->entry = entry[j];
+                    file->entry_sector = current_sector + i;
+                    file->entry_index = j;
+                    return true;
+                }
+            }
+        }
+        current_cluster = fat32_get_next_cluster(current_cluster);
+    }
+    return false;
+}
 
-    // Allocate the first cluster for the file
-    uint32_t first_cluster = fat32_allocate_cluster();
-    if (!first_cluster) return false;
+static uint32_t fat32_file_cluster(const fat32_file_t* file) {
+    return ((uint32_t)file->entry.first_cluster_high << 16) | file->entry.first_cluster_low;
+}
 
-    // Create or update the directory entry
-    memset(entry, 0, sizeof(fat32_dir_entry_t));
-    memcpy(entry->name, fat_name, 11); // Use the FAT32-compliant name
-    entry->attributes = 0x20; // Archive attribute
-    entry->first_cluster_high = (uint16_t)(first_cluster >> 16);
-    entry->first_cluster_low = (uint16_t)(first_cluster & 0xFFFF);
-    entry->file_size = size;
+static void fat32_reset_map(fat32_file_t* file) {
+    file->map.first_cluster = fat32_file_cluster(file);
+    file->map.count = 0;
+    file->map.complete = false;
+}
 
-    // Write the updated directory entry to disk
-    if (!ata_write_sectors(entry_sector, 1, dir_buffer)) {
+bool fat32_open(const char* name, bool create, fat32_file_t* file) {
+    char fat_name[11];
+    if (!is_initialized || !file || !fat32_convert_to_fat_name(name, fat_name)) {
         return false;
     }
 
-    // Write file data to clusters
-    uint32_t bytes_written = 0;
-    uint32_t current_data_cluster = first_cluster;
+    if (!fat32_lookup(fat_name, file)) {
+        if (!create || !fat32_create_file(fat_name) || !fat32_lookup(fat_name, file)) {
+            return false;
+        }
+    }
 
-    while (bytes_written < size) {
-        uint32_t data_sector = cluster_to_lba(current_data_cluster);
-        uint32_t bytes_to_write = size - bytes_written;
-        uint32_t sectors_to_write = (bytes_to_write + 511) / 512;
+    fat32_reset_map(file);
+    file->next = open_files;
+    open_files = file;
+    return true;
+}
 
-        if (sectors_to_write > sectors_per_cluster) {
-            sectors_to_write = sectors_per_cluster;
+void fat32_close(fat32_file_t* file) {
+    for (fat32_file_t** link = &open_files; *link; link = &(*link)->next) {
+        if (*link == file) {
+            *link = file->next;
+            break;
         }
+    }
+}
+
+bool fat32_read_at(fat32_file_t* file, uint32_t offset, void* buffer, uint32_t* length) {
+    if (!is_initialized || !file || !buffer || !length) {
+        return false;
+    }
+    if (offset >= file->entry.file_size) {
+        *length = 0;
+        return true;
+    }
+    if (*length > file->entry.file_size - offset) {
+        *length = file->entry.file_size - offset;
+    }
+    return fat32_read_extents(&file->map, offset, buffer, *length, length);
+}
 
-        // Write the data to the current cluster
-        if (!ata_write_sectors(data_sector, sectors_to_write, (uint8_t*)data + bytes_written)) {
+// Grow the chain to hold clusters clusters, linking new runs to its tail
+static bool fat32_extend_chain(fat32_file_t* file, uint32_t clusters) {
+    uint32_t cluster_bytes = sectors_per_cluster * 512;
+    uint32_t size = file->entry.file_size;
+    uint32_t have = 0;
+    uint32_t last = 0;
+
+    // The chain holds at least the clusters the size needs, start there
+    fat32_extent_t extent;
+    uint32_t index = size ? (size - 1) / cluster_bytes : 0;
+    while (fat32_extent_lookup(&file->map, index, &extent)) {
+        index = extent.file_cluster + extent.count;
+        have = index;
+        last = extent.cluster + extent.count - 1;
+    }
+    if (have >= clusters) {
+        return true;
+    }
+
+    uint32_t first = fat32_file_cluster(file);
+    while (have < clusters) {
+        uint32_t run = 0;
+        uint32_t start = fat32_allocate_run(clusters - have, &run);
+        if (!start) {
+            vga_writestr("Error: Disk full\n");
             return false;
         }
+        if (last) {
+            fat32_write_fat_entry(last, start);
+        } else {
+            file->entry.first_cluster_high = (uint16_t)(start >> 16);
+            file->entry.first_cluster_low = (uint16_t)(start & 0xFFFF);
+        }
+        last = start + run - 1;
+        have += run;
+    }
 
-        bytes_written += sectors_to_write * 512;
+    // Maps of this chain end too early now
+    fat32_extent_forget(first);
+    fat32_reset_map(file);
+    return true;
+}
 
-        // Allocate the next cluster if more data needs to be written
-        if (bytes_written < size) {
-            uint32_t next_cluster = fat32_allocate_cluster();
-            if (!next_cluster) return false;
+// Write the directory entry back and share it with other handles
+static bool fat32_update_entry(fat32_file_t* file) {
+    uint8_t buffer[512];
+    if (!bcache_read(fs_dev, file->entry_sector, buffer)) {
+        return false;
+    }
+    ((fat32_dir_entry_t*)buffer)[file->entry_index] = file->entry;
+    if (!bcache_write(fs_dev, file->entry_sector, buffer, 0)) {
+        return false;
+    }
 
-            if (!fat32_write_fat_entry(current_data_cluster, next_cluster)) {
-                return false;
+    for (fat32_file_t* other = open_files; other; other = other->next) {
+        if (other != file && other->entry_sector == file->entry_sector &&
+            other->entry_index == file->entry_index) {
+            other->entry = file->entry;
+            fat32_reset_map(other);
+        }
+    }
+    return true;
+}
+
+// Write length bytes at offset inside clusters the chain already has.
+// The device is plugged for the whole range: whole sectors are queued
+// straight from the caller's buffer, one request per extent, and go out
+// sorted and merged on unplug. Partial ones are read, patched and queued
+// from a bounce sector, the first and last piece each have their own.
+// NULL data writes zeroes, whole sectors of them FAT32_ZERO_SECTORS at
+// a time.
+static bool fat32_write_extents(fat32_file_t* file, uint32_t offset, const uint8_t* data,
+                                uint32_t length) {
+    static uint8_t sectors[2][512] __attribute__((aligned(16)));
+    static uint8_t zeroes[FAT32_ZERO_SECTORS * 512] __attribute__((aligned(16)));
+    uint32_t cluster_bytes = sectors_per_cluster * 512;
+    uint32_t max_bytes = blockdev_max_sectors(fs_dev) * 512;
+    uint32_t old_size = file->entry.file_size;
+    uint32_t done = 0;
+    bool ok = true;
+
+    blockdev_plug(fs_dev);
+    while (ok && done < length) {
+        uint32_t pos = offset + done;
+        fat32_extent_t extent;
+        if (!fat32_extent_lookup(&file->map, pos / cluster_bytes, &extent)) {
+            ok = false;
+            break;
+        }
+
+        uint32_t lba = cluster_to_lba(extent.cluster) + (pos - extent.file_cluster * cluster_bytes) / 512;
+        uint32_t skip = pos % 512;
+        uint32_t bytes = length - done;
+        uint32_t count = 1;
+
+        if (skip || bytes < 512) {
+            uint8_t* sector = sectors[done == 0 ? 0 : 1];
+            if (bytes > 512 - skip) {
+                bytes = 512 - skip;
+            }
+            // Sectors past the old end hold nothing worth keeping
+            if (pos - skip < old_size) {
+                if (!blockdev_read(fs_dev, lba, 1, sector)) {
+                    ok = false;
+                    break;
+                }
+            } else {
+                memset(sector, 0, 512);
+            }
+            if (data) {
+                memcpy(sector + skip, data + done, bytes);
+            } else {
+                memset(sector + skip, 0, bytes);
             }
+            ok = blockdev_queue_write(fs_dev, lba, 1, sector, 0);
+        } else {
+            uint32_t avail = (extent.file_cluster + extent.count) * cluster_bytes - pos;
+            if (bytes > avail) {
+                bytes = avail;
+            }
+            if (bytes > max_bytes) {
+                bytes = max_bytes;
+            }
+            if (!data && bytes > sizeof(zeroes)) {
+                bytes = sizeof(zeroes);
+            }
+            bytes &= ~511u;
+            count = bytes / 512;
+            ok = blockdev_queue_write(fs_dev, lba, count, data ? data + done : zeroes, 0);
+        }
 
-            current_data_cluster = next_cluster;
+        // The sectors may be cached, even dirty, from an earlier life as
+        // directory data. Dropped now so nothing older is written back
+        // over the queued data.
+        bcache_invalidate(fs_dev, lba, count);
+        done += bytes;
+    }
+
+    // Failures among the queued writes show up here
+    if (!blockdev_unplug(fs_dev)) {
+        ok = false;
+    }
+    return ok;
+}
+
+// Cut the chain after the clusters size needs and free the rest. The
+// directory entry is left for the caller to update.
+static bool fat32_shrink_chain(fat32_file_t* file, uint32_t size) {
+    uint32_t cluster_bytes = sectors_per_cluster * 512;
+    uint32_t keep = (size + cluster_bytes - 1) / cluster_bytes;
+    uint32_t first = fat32_file_cluster(file);
+    uint32_t tail;
+
+    if (first < 2) {
+        return true;    // No clusters yet
+    }
+    if (keep == 0) {
+        tail = first;
+        file->entry.first_cluster_high = 0;
+        file->entry.first_cluster_low = 0;
+    } else {
+        fat32_extent_t extent;
+        if (!fat32_extent_lookup(&file->map, keep - 1, &extent)) {
+            return true;    // Chain is no longer than that
         }
+        uint32_t last = extent.cluster + (keep - 1 - extent.file_cluster);
+        tail = fat32_get_next_cluster(last);
+        if (tail == 0x0FFFFFF7) {
+            return false;
+        }
+        if (tail >= 0x0FFFFFF8) {
+            return true;
+        }
+        if (!fat32_write_fat_entry(last, 0x0FFFFFFF)) {
+            return false;
+        }
+    }
+
+    fat32_extent_forget(first);
+    fat32_reset_map(file);
+    return fat32_free_clusters(tail);
+}
+
+// Write at any offset, growing the chain and filling a gap past the end
+// with zeroes. Only the clusters the range covers are touched. The size
+// in the entry is updated but not written back.
+static bool fat32_write_range(fat32_file_t* file, uint32_t offset, const uint8_t* data,
+                              uint32_t length) {
+    uint32_t size = file->entry.file_size;
+    uint32_t end = offset + length;
+    if (end < offset) {
+        return false;   // Past 4 GiB
+    }
+    if (length == 0) {
+        return true;
     }
 
-    // Mark the end of the FAT chain
-    if (!fat32_write_fat_entry(current_data_cluster, 0x0FFFFFFF)) {
+    uint32_t cluster_bytes = sectors_per_cluster * 512;
+    bool ok = fat32_extend_chain(file, (end + cluster_bytes - 1) / cluster_bytes);
+    if (ok && ((offset > size && !fat32_write_extents(file, size, NULL, offset - size)) ||
+               !fat32_write_extents(file, offset, data, length))) {
+        vga_writestr("Error: Failed to write file data\n");
+        ok = false;
+    }
+    if (!ok) {
+        // Give back what the write allocated, also runs linked before
+        // the disk filled up
+        if (fat32_shrink_chain(file, size)) {
+            fat32_update_entry(file);
+        }
         return false;
     }
 
+    if (end > size) {
+        file->entry.file_size = end;
+    }
     return true;
 }
 
+// Consistency point: data, FAT and directory entry reach the medium.
+// With write-back the metadata follows on the next sync instead.
+static bool fat32_commit(void) {
+    if (bcache_writeback_enabled()) {
+        return true;
+    }
+    return fat32_flush_fat() && blockdev_flush(fs_dev);
+}
+
+bool fat32_write_at(fat32_file_t* file, uint32_t offset, const void* data, uint32_t length) {
+    if (!is_initialized || !file || !data) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    return fat32_write_range(file, offset, data, length) && fat32_update_entry(file) &&
+           fat32_commit();
+}
+
+bool fat32_append(fat32_file_t* file, const void* data, uint32_t length) {
+    return file && fat32_write_at(file, file->entry.file_size, data, length);
+}
+
+// Shrinking frees only the clusters past the new end, growing zero-fills
+bool fat32_truncate(fat32_file_t* file, uint32_t size) {
+    if (!is_initialized || !file) {
+        return false;
+    }
+
+    uint32_t old_size = file->entry.file_size;
+    if (size == old_size) {
+        return true;
+    }
+
+    bool ok;
+    if (size > old_size) {
+        ok = fat32_write_range(file, old_size, NULL, size - old_size);
+    } else {
+        ok = fat32_shrink_chain(file, size);
+        file->entry.file_size = size;
+    }
+    return ok && fat32_update_entry(file) && fat32_commit();
+}
+
+// Replace a file's contents, creating it if needed. The clusters it
+// already has are overwritten in place and only those past the new size
+// are freed.
+bool fat32_write_file(const char* name, const void* data, uint32_t size) {
+    fat32_file_t file;
+    if (!is_initialized || !data || !fat32_open(name, true, &file)) {
+        return false;
+    }
+    if (file.entry.attributes & ATTR_DIRECTORY) {
+        vga_writestr("Error: Is a directory\n");
+        fat32_close(&file);
+        return false;
+    }
+
+    bool ok = fat32_write_range(&file, 0, data, size);
+    if (ok && size < file.entry.file_size) {
+        ok = fat32_shrink_chain(&file, size);
+        file.entry.file_size = size;
+    }
+    ok = ok && fat32_update_entry(&file) && fat32_commit();
+
+    fat32_close(&file);
+    return ok;
+}
+
 bool fat32_read_file(const char* name, void* buffer, uint32_t* size) {
     if (!is_initialized || !buffer || !size) {
         if (debug) vga_writestr("[FAT32] Invalid parameters\n");
@@ -754,10 +1758,10 @@ bool fat32_read_file(const char* name, void* buffer, uint32_t* size) {
 
     // Find the file entry
     while (current_cluster < 0x0FFFFFF8 && !found) {
-        uint32_t current_sector = cluster_to_lba(current_cluster);
+        uint32_t current_sector = fat32_dir_sector(current_cluster);
 
         for (uint32_t i = 0; i < sectors_per_cluster && !found; i++) {
-            if (!ata_read_sectors(current_sector + i, 1, dir_buffer)) {
+            if (!bcache_read(fs_dev, current_sector + i, dir_buffer)) {
                 if (debug) vga_writestr("[FAT32] Failed to read directory sector\n");
                 return false;
             }
@@ -806,41 +1810,11 @@ bool fat32_read_file(const char* name, void* buffer, uint32_t* size) {
         return false;
     }
 
-    // Read file data
     *size = entry->file_size;
     uint32_t bytes_read = 0;
-    uint32_t current_data_cluster = first_cluster;
-
-    while (bytes_read < entry->file_size && current_data_cluster < 0x0FFFFFF8) {
-        uint32_t data_sector = cluster_to_lba(current_data_cluster);
-        vga_writestr("[FAT32] Reading sector 0x");
-        for (int i = 7; i >= 0; i--) {
-            char hex = "0123456789ABCDEF"[(data_sector >> (i * 4)) & 0xF];
-            char str[2] = {hex, 0};
-            vga_writestr(str);
-        }
-        vga_writestr("\n");
-
-        // Calculate how much to read
-        uint32_t bytes_to_read = entry->file_size - bytes_read;
-        uint32_t sectors_to_read = (bytes_to_read + 511) / 512;
-        if (sectors_to_read > sectors_per_cluster) {
-            sectors_to_read = sectors_per_cluster;
-        }
-
-        vga_writestr("[FAT32] Reading ");
-        uint32_t_to_str(sectors_to_read, size_str);
-        vga_writestr(size_str);
-        vga_writestr(" sectors\n");
-
-        // Read data
-        if (!ata_read_sectors(data_sector, sectors_to_read, (uint8_t*)buffer + bytes_read)) {
-            vga_writestr("[FAT32] Failed to read data sectors\n");
-            return false;
-        }
-
-        bytes_read += sectors_to_read * 512;
-        current_data_cluster = fat32_get_next_cluster(current_data_cluster);
+    if (!fat32_read_extents(fat32_extent_map(first_cluster), 0, buffer, entry->file_size, &bytes_read)) {
+        vga_writestr("[FAT32] Failed to read data sectors\n");
+        return false;
     }
 
     vga_writestr("[FAT32] Successfully read ");
@@ -123,3 +123,8 @@ bool keyboard_is_shift_pressed(void) {
 bool keyboard_is_caps_on(void) {
     return caps_lock;
 }
+
+// True when keyboard_read would not have to wait
+bool keyboard_has_data(void) {
+    return inb(KEYBOARD_STATUS_PORT) & KEYBOARD_OUTPUT_FULL;
+}
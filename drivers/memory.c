@@ -24,6 +24,19 @@ void* kmalloc(size_t size) {
     return ptr;
 }
 
+// For device structures with alignment rules, align must be a power of two
+void* kmalloc_aligned(size_t size, size_t align) {
+    size_t start = ((size_t)&heap[heap_ptr] + align - 1) & ~(align - 1);
+    size_t offset = start - (size_t)heap;
+    if (offset + size > HEAP_SIZE) {
+        return NULL;  // Out of memory
+    }
+
+    heap_ptr = offset + size;
+    heap_ptr = (heap_ptr + 3) & ~3;
+    return (void*)start;
+}
+
 void kfree(void* ptr) {
     // This is a very simple allocator that doesn't actually free memory
     // In a real kernel, you'd want to implement proper memory management
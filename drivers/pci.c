@@ -0,0 +1,226 @@
+#include "../include/pci.h"
+#include "../include/io.h"
+#include "../include/string.h"
+#include "../include/vga.h"
+
+static pci_device_t pci_devices[PCI_MAX_DEVICES];
+static int pci_count = 0;
+static bool pci_scanned = false;
+
+static uint32_t pci_config_address(pci_address_t addr, uint8_t offset) {
+    return 0x80000000 |
+           ((uint32_t)addr.bus << 16) |
+           ((uint32_t)(addr.slot & 0x1F) << 11) |
+           ((uint32_t)(addr.func & 0x07) << 8) |
+           (offset & 0xFC);
+}
+
+uint32_t pci_config_read32(pci_address_t addr, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(addr, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_config_read16(pci_address_t addr, uint8_t offset) {
+    uint32_t value = pci_config_read32(addr, offset);
+    return (uint16_t)(value >> ((offset & 2) * 8));
+}
+
+uint8_t pci_config_read8(pci_address_t addr, uint8_t offset) {
+    uint32_t value = pci_config_read32(addr, offset);
+    return (uint8_t)(value >> ((offset & 3) * 8));
+}
+
+void pci_config_write32(pci_address_t addr, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(addr, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write16(pci_address_t addr, uint8_t offset, uint16_t value) {
+    uint32_t old = pci_config_read32(addr, offset);
+    uint32_t shift = (offset & 2) * 8;
+    old &= ~(0xFFFFu << shift);
+    old |= (uint32_t)value << shift;
+    pci_config_write32(addr, offset, old);
+}
+
+// Size a BAR by writing all ones and reading back the address mask.
+// Decoding is off meanwhile so the probe value is never claimed.
+static void pci_read_bars(pci_device_t* dev) {
+    uint16_t cmd = pci_config_read16(dev->addr, PCI_COMMAND);
+    pci_config_write16(dev->addr, PCI_COMMAND, cmd & ~(PCI_CMD_IO | PCI_CMD_MEMORY));
+
+    for (int i = 0; i < PCI_MAX_BARS; i++) {
+        uint8_t offset = PCI_BAR0 + i * 4;
+        uint32_t value = pci_config_read32(dev->addr, offset);
+        pci_config_write32(dev->addr, offset, 0xFFFFFFFF);
+        uint32_t mask = pci_config_read32(dev->addr, offset);
+        pci_config_write32(dev->addr, offset, value);
+
+        pci_bar_t* bar = &dev->bars[i];
+        if (mask == 0 || mask == 0xFFFFFFFF) {
+            continue;   // Not implemented
+        }
+
+        if (value & PCI_BAR_IO) {
+            bar->io = true;
+            bar->base = value & ~0x3u;
+            bar->size = (~(mask & ~0x3u) + 1) & 0xFFFF;
+        } else {
+            bar->base = value & ~0xFu;
+            bar->size = ~(mask & ~0xFu) + 1;
+            bar->prefetchable = (value & PCI_BAR_PREFETCH) != 0;
+
+            // The upper half lives in the next BAR. Nothing above 4 GiB
+            // is reachable without paging, so it is only skipped.
+            if (value & PCI_BAR_TYPE_64) {
+                i++;
+            }
+        }
+    }
+
+    pci_config_write16(dev->addr, PCI_COMMAND, cmd);
+}
+
+static uint8_t pci_find_capability(pci_address_t addr, uint8_t id) {
+    if (!(pci_config_read16(addr, PCI_STATUS) & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+
+    // Bounded walk, a broken list must not loop forever
+    uint8_t offset = pci_config_read8(addr, PCI_CAP_PTR) & 0xFC;
+    for (int i = 0; offset && i < 48; i++) {
+        if (pci_config_read8(addr, offset) == id) {
+            return offset;
+        }
+        offset = pci_config_read8(addr, offset + 1) & 0xFC;
+    }
+    return 0;
+}
+
+static void pci_add_device(pci_address_t addr) {
+    if (pci_count >= PCI_MAX_DEVICES) {
+        vga_writestr("PCI Error: Too many devices\n");
+        return;
+    }
+
+    pci_device_t* dev = &pci_devices[pci_count++];
+    memset(dev, 0, sizeof(*dev));
+    dev->addr = addr;
+    dev->vendor_id = pci_config_read16(addr, PCI_VENDOR_ID);
+    dev->device_id = pci_config_read16(addr, PCI_DEVICE_ID);
+    dev->class_code = pci_config_read8(addr, PCI_CLASS);
+    dev->subclass = pci_config_read8(addr, PCI_SUBCLASS);
+    dev->prog_if = pci_config_read8(addr, PCI_PROG_IF);
+    dev->revision = pci_config_read8(addr, PCI_REVISION);
+    dev->irq_line = pci_config_read8(addr, PCI_INTERRUPT_LINE);
+    dev->msi_cap = pci_find_capability(addr, PCI_CAP_ID_MSI);
+
+    // Only type 0 headers have six BARs, bridges are listed but not sized
+    if ((pci_config_read8(addr, PCI_HEADER_TYPE) & 0x7F) == 0) {
+        pci_read_bars(dev);
+    }
+}
+
+// Brute-force scan of every bus/slot/function
+void pci_init(void) {
+    if (pci_scanned) {
+        return;
+    }
+    pci_scanned = true;
+
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            for (uint8_t func = 0; func < 8; func++) {
+                pci_address_t cur = { (uint8_t)bus, slot, func };
+
+                if (pci_config_read16(cur, PCI_VENDOR_ID) == 0xFFFF) {
+                    if (func == 0) break;  // No device in this slot
+                    continue;
+                }
+
+                pci_add_device(cur);
+
+                // Single-function devices only answer on function 0
+                if (func == 0 && !(pci_config_read8(cur, PCI_HEADER_TYPE) & 0x80)) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int pci_device_count(void) {
+    pci_init();
+    return pci_count;
+}
+
+pci_device_t* pci_get_device(int index) {
+    pci_init();
+    if (index < 0 || index >= pci_count) {
+        return NULL;
+    }
+    return &pci_devices[index];
+}
+
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass) {
+    pci_init();
+    for (int i = 0; i < pci_count; i++) {
+        if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+pci_device_t* pci_find_device(uint16_t vendor, uint16_t device) {
+    pci_init();
+    for (int i = 0; i < pci_count; i++) {
+        if (pci_devices[i].vendor_id == vendor && pci_devices[i].device_id == device) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+static bool pci_id_matches(const pci_device_id_t* id, const pci_device_t* dev) {
+    uint16_t class_id = ((uint16_t)dev->class_code << 8) | dev->subclass;
+    return (id->vendor_id == PCI_ANY_ID || id->vendor_id == dev->vendor_id) &&
+           (id->device_id == PCI_ANY_ID || id->device_id == dev->device_id) &&
+           (id->class_id == PCI_ANY_ID || id->class_id == class_id);
+}
+
+int pci_register_driver(pci_driver_t* driver) {
+    int claimed = 0;
+
+    pci_init();
+    for (int i = 0; i < pci_count; i++) {
+        pci_device_t* dev = &pci_devices[i];
+        if (dev->driver) {
+            continue;
+        }
+
+        for (const pci_device_id_t* id = driver->ids; id->vendor_id; id++) {
+            if (pci_id_matches(id, dev)) {
+                if (driver->probe(dev)) {
+                    dev->driver = driver;
+                    claimed++;
+                }
+                break;
+            }
+        }
+    }
+    return claimed;
+}
+
+void pci_enable_device(pci_device_t* dev, bool bus_master) {
+    uint16_t cmd = pci_config_read16(dev->addr, PCI_COMMAND);
+    for (int i = 0; i < PCI_MAX_BARS; i++) {
+        if (dev->bars[i].size) {
+            cmd |= dev->bars[i].io ? PCI_CMD_IO : PCI_CMD_MEMORY;
+        }
+    }
+    if (bus_master) {
+        cmd |= PCI_CMD_BUS_MASTER;
+    }
+    pci_config_write16(dev->addr, PCI_COMMAND, cmd);
+}
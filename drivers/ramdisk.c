@@ -0,0 +1,78 @@
+#include "../include/ramdisk.h"
+#include "../include/blockdev.h"
+#include "../include/string.h"
+#include "../include/vga.h"
+
+// Set when the Makefile links an image in with RAMDISK_IMAGE=<file>
+extern uint8_t _binary_ramdisk_img_start[] __attribute__((weak));
+extern uint8_t _binary_ramdisk_img_end[] __attribute__((weak));
+
+typedef struct {
+    blockdev_t dev;
+    uint8_t* base;
+} ramdisk_t;
+
+static ramdisk_t ramdisks[RAMDISK_MAX_DEVICES];
+static int ramdisk_count = 0;
+
+static bool ramdisk_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    ramdisk_t* rd = (ramdisk_t*)dev->driver_data;
+    memcpy(buffer, rd->base + (uint32_t)lba * 512, count * 512);
+    return true;
+}
+
+static bool ramdisk_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    (void)flags;
+    ramdisk_t* rd = (ramdisk_t*)dev->driver_data;
+    memcpy(rd->base + (uint32_t)lba * 512, buffer, count * 512);
+    return true;
+}
+
+// Memory is the medium, so there is no cache to flush
+static const blockdev_ops_t ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .flush = NULL,
+    .submit = NULL,
+};
+
+// Register a RAM disk as "ram<n>" backed by the given memory
+bool ramdisk_create(void* base, uint32_t size) {
+    if (ramdisk_count >= RAMDISK_MAX_DEVICES || size < 512) {
+        return false;
+    }
+
+    ramdisk_t* rd = &ramdisks[ramdisk_count];
+    strcpy(rd->dev.name, "ram0");
+    rd->dev.name[3] = '0' + ramdisk_count;
+    rd->dev.sector_size = 512;
+    rd->dev.sector_count = size / 512;
+    rd->dev.ops = &ramdisk_ops;
+    rd->dev.driver_data = rd;
+    rd->base = (uint8_t*)base;
+
+    if (!blockdev_register(&rd->dev)) {
+        return false;
+    }
+
+    ramdisk_count++;
+    return true;
+}
+
+// Create RAM disks from the built-in image and the multiboot modules.
+// Modules are loaded by the bootloader, e.g. qemu -initrd disk.img.
+int ramdisk_init(const multiboot_info_t* mbi) {
+    if (_binary_ramdisk_img_start && _binary_ramdisk_img_end) {
+        ramdisk_create(_binary_ramdisk_img_start,
+                       _binary_ramdisk_img_end - _binary_ramdisk_img_start);
+    }
+
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_MODS)) {
+        const multiboot_module_t* mods = (const multiboot_module_t*)mbi->mods_addr;
+        for (uint32_t i = 0; i < mbi->mods_count; i++) {
+            ramdisk_create((void*)mods[i].mod_start, mods[i].mod_end - mods[i].mod_start);
+        }
+    }
+
+    return ramdisk_count;
+}
@@ -0,0 +1,47 @@
+#include "../include/timer.h"
+#include "../include/io.h"
+#include "../include/idt.h"
+
+static volatile uint32_t ticks = 0;
+static uint32_t tsc_khz = 0;
+
+static void timer_irq_handler(struct registers_t* regs) {
+    (void)regs;
+    ticks++;
+}
+
+void timer_init(void) {
+    uint32_t divisor = PIT_BASE_HZ / TIMER_HZ;
+
+    // Channel 0, lobyte/hibyte, mode 3 (square wave)
+    outb(PIT_COMMAND, 0x36);
+    outb(PIT_CHANNEL0, (uint8_t)(divisor & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
+
+    irq_install_handler(IRQ_TIMER, timer_irq_handler);
+}
+
+uint32_t timer_ticks(void) {
+    return ticks;
+}
+
+
+// Count TSC cycles across a few timer ticks. Needs interrupts, so it is
+// measured on first use rather than in timer_init.
+uint32_t timer_tsc_khz(void) {
+    if (tsc_khz || !interrupts_enabled()) {
+        return tsc_khz;
+    }
+
+    uint32_t start = ticks;
+    while (ticks == start) {
+        asm volatile("pause");
+    }
+    start = ticks;
+    uint64_t tsc_start = timer_rdtsc();
+    while (ticks - start < 10) {
+        asm volatile("pause");
+    }
+    tsc_khz = (uint32_t)(timer_rdtsc() - tsc_start) / 10;
+    return tsc_khz;
+}
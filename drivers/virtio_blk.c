@@ -0,0 +1,463 @@
+#include "../include/virtio_blk.h"
+#include "../include/blockdev.h"
+#include "../include/pci.h"
+#include "../include/io.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+#include "../include/vga.h"
+
+// One request in flight. The indirect table comes first to keep it
+// 16-byte aligned.
+typedef struct {
+    virtq_desc_t table[VIRTIO_BLK_SEGMENTS + 2];
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;
+    bool flush_after;               // Emulated FUA: flush once the write is done
+    blockdev_request_t* req;
+} __attribute__((aligned(16))) virtio_blk_slot_t;
+
+typedef struct {
+    blockdev_t dev;
+    uint16_t io_base;
+
+    // Split virtqueue 0
+    uint16_t queue_size;
+    virtq_desc_t* desc;
+    virtq_avail_t* avail;
+    virtq_used_t* used;
+    uint16_t last_used;
+    bool notify_pending;            // Published since the last doorbell
+
+    // Negotiated features
+    bool indirect;
+    bool flush;
+    bool read_only;
+    bool discard;
+    uint32_t size_max;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+
+    // Each slot owns a fixed range of ring descriptors: one indirect
+    // descriptor, or a whole chain without indirect support
+    uint32_t descs_per_slot;
+    uint32_t slot_count;
+    uint64_t busy;
+    virtio_blk_slot_t* slots;
+} virtio_blk_t;
+
+static virtio_blk_t virtio_blk_devices[VIRTIO_BLK_MAX_DEVICES];
+static int virtio_blk_count = 0;
+
+static uint32_t virtq_align(uint32_t size) {
+    return (size + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+}
+
+// Legacy layout: descriptors and available ring, then the used ring on
+// the next page
+static uint32_t virtq_used_offset(uint16_t size) {
+    return virtq_align(sizeof(virtq_desc_t) * size + 6 + 2 * size);
+}
+
+static uint32_t virtq_total_size(uint16_t size) {
+    return virtq_used_offset(size) + virtq_align(6 + sizeof(virtq_used_elem_t) * size);
+}
+
+// Ring the doorbell once for everything published so far
+static void virtio_blk_notify(virtio_blk_t* vb) {
+    if (!vb->notify_pending) {
+        return;
+    }
+    vb->notify_pending = false;
+
+    // The index store must be visible before the device's flag is read
+    asm volatile("mfence" ::: "memory");
+    if (!(vb->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        outw(vb->io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Fill the slot's descriptors: header, data segments, status byte.
+// Returns false if the buffer needs more segments than a slot holds.
+static bool virtio_blk_publish(virtio_blk_t* vb, uint32_t slot_index, uint32_t type,
+                               uint64_t lba, void* buffer, uint32_t bytes) {
+    virtio_blk_slot_t* slot = &vb->slots[slot_index];
+    uint16_t head = (uint16_t)(slot_index * vb->descs_per_slot);
+    virtq_desc_t* d = vb->indirect ? slot->table : &vb->desc[head];
+    uint16_t base = vb->indirect ? 0 : head;
+    uint16_t n = 0;
+
+    slot->hdr.type = type;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = lba;
+    slot->status = 0xFF;
+
+    d[n].addr = (uint32_t)&slot->hdr;
+    d[n].len = sizeof(slot->hdr);
+    d[n].flags = VIRTQ_DESC_F_NEXT;
+    d[n].next = base + n + 1;
+    n++;
+
+    uint8_t* data = (uint8_t*)buffer;
+    while (bytes > 0) {
+        if (n > VIRTIO_BLK_SEGMENTS) {
+            vga_writestr("virtio Error: Too many segments\n");
+            return false;
+        }
+        uint32_t seg = vb->size_max && bytes > vb->size_max ? vb->size_max : bytes;
+        d[n].addr = (uint32_t)data;
+        d[n].len = seg;
+        d[n].flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+        d[n].next = base + n + 1;
+        data += seg;
+        bytes -= seg;
+        n++;
+    }
+
+    d[n].addr = (uint32_t)&slot->status;
+    d[n].len = 1;
+    d[n].flags = VIRTQ_DESC_F_WRITE;
+    d[n].next = 0;
+    n++;
+
+    if (vb->indirect) {
+        vb->desc[head].addr = (uint32_t)slot->table;
+        vb->desc[head].len = n * sizeof(virtq_desc_t);
+        vb->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+        vb->desc[head].next = 0;
+    }
+
+    // Descriptors before the ring entry, the ring entry before the index
+    vb->avail->ring[vb->avail->idx & (vb->queue_size - 1)] = head;
+    asm volatile("" ::: "memory");
+    vb->avail->idx++;
+    vb->notify_pending = true;
+    return true;
+}
+
+static void virtio_blk_reap(virtio_blk_t* vb) {
+    while (vb->last_used != vb->used->idx) {
+        asm volatile("" ::: "memory");
+        virtq_used_elem_t* elem = &vb->used->ring[vb->last_used & (vb->queue_size - 1)];
+        uint32_t slot_index = elem->id / vb->descs_per_slot;
+        vb->last_used++;
+
+        virtio_blk_slot_t* slot = &vb->slots[slot_index];
+        bool ok = slot->status == VIRTIO_BLK_S_OK;
+
+        if (ok && slot->flush_after) {
+            slot->flush_after = false;
+            virtio_blk_publish(vb, slot_index, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+            virtio_blk_notify(vb);
+            continue;
+        }
+
+        blockdev_request_t* req = slot->req;
+        slot->req = NULL;
+        vb->busy &= ~(1ull << slot_index);
+        blockdev_complete(req, ok);
+    }
+}
+
+static uint32_t virtio_blk_alloc_slot(virtio_blk_t* vb) {
+    for (;;) {
+        for (uint32_t i = 0; i < vb->slot_count; i++) {
+            if (!(vb->busy & (1ull << i))) {
+                return i;
+            }
+        }
+        // Queue full: start what is waiting and reap
+        virtio_blk_notify(vb);
+        virtio_blk_reap(vb);
+    }
+}
+
+// Requests are only published here, the doorbell rings on commit
+static bool virtio_blk_submit(blockdev_t* dev, blockdev_request_t* req) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->driver_data;
+    bool write = req->op == BLOCKDEV_OP_WRITE;
+
+    if (req->op == BLOCKDEV_OP_FLUSH && !vb->flush) {
+        // Without the flush feature the device writes through
+        blockdev_complete(req, true);
+        return true;
+    }
+    if (write && vb->read_only) {
+        vga_writestr("virtio Error: Device is read-only\n");
+        blockdev_complete(req, false);
+        return false;
+    }
+    if (req->op != BLOCKDEV_OP_FLUSH && (req->count == 0 || req->count > vb->dev.max_sectors)) {
+        vga_writestr("virtio Error: Bad transfer\n");
+        blockdev_complete(req, false);
+        return false;
+    }
+
+    uint32_t type = req->op == BLOCKDEV_OP_FLUSH ? VIRTIO_BLK_T_FLUSH :
+                    write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    uint32_t bytes = req->op == BLOCKDEV_OP_FLUSH ? 0 : req->count * 512;
+
+    uint32_t slot_index = virtio_blk_alloc_slot(vb);
+    virtio_blk_slot_t* slot = &vb->slots[slot_index];
+    slot->req = req;
+    slot->flush_after = write && (req->flags & BLOCKDEV_WRITE_FUA) && vb->flush;
+
+    if (!virtio_blk_publish(vb, slot_index, type, req->lba, req->buffer, bytes)) {
+        slot->req = NULL;
+        blockdev_complete(req, false);
+        return false;
+    }
+    vb->busy |= 1ull << slot_index;
+    return true;
+}
+
+static void virtio_blk_commit(blockdev_t* dev) {
+    virtio_blk_notify((virtio_blk_t*)dev->driver_data);
+}
+
+static void virtio_blk_poll(blockdev_t* dev) {
+    virtio_blk_reap((virtio_blk_t*)dev->driver_data);
+}
+
+// Run one request to completion, for the synchronous entry points
+static bool virtio_blk_run(virtio_blk_t* vb, blockdev_request_t* req) {
+    req->done = false;
+    req->callback = NULL;
+    req->dev = NULL;
+    virtio_blk_submit(&vb->dev, req);
+    virtio_blk_notify(vb);
+    while (!req->done) {
+        virtio_blk_reap(vb);
+    }
+    return req->success;
+}
+
+static bool virtio_blk_transfer(blockdev_t* dev, uint8_t op, uint64_t lba, uint32_t count,
+                                void* buffer, uint32_t flags) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->driver_data;
+    uint8_t* buf = (uint8_t*)buffer;
+    uint32_t max_sectors = vb->dev.max_sectors;
+
+    while (count > 0) {
+        uint32_t chunk = count < max_sectors ? count : max_sectors;
+        blockdev_request_t req;
+        memset(&req, 0, sizeof(req));
+        req.op = op;
+        req.flags = flags;
+        req.lba = lba;
+        req.count = chunk;
+        req.buffer = buf;
+        if (!virtio_blk_run(vb, &req)) {
+            return false;
+        }
+        lba += chunk;
+        count -= chunk;
+        buf += chunk * 512;
+    }
+    return true;
+}
+
+static bool virtio_blk_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return virtio_blk_transfer(dev, BLOCKDEV_OP_READ, lba, count, buffer, 0);
+}
+
+static bool virtio_blk_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags) {
+    return virtio_blk_transfer(dev, BLOCKDEV_OP_WRITE, lba, count, (void*)buffer, flags);
+}
+
+static bool virtio_blk_flush(blockdev_t* dev) {
+    blockdev_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.op = BLOCKDEV_OP_FLUSH;
+    return virtio_blk_run((virtio_blk_t*)dev->driver_data, &req);
+}
+
+// One DISCARD request carries up to max_discard_seg ranges
+static bool virtio_blk_discard(blockdev_t* dev, const blockdev_range_t* ranges, uint32_t count) {
+    static virtio_blk_discard_t segs[VIRTIO_BLK_DISCARD_SEGS] __attribute__((aligned(16)));
+    virtio_blk_t* vb = (virtio_blk_t*)dev->driver_data;
+
+    if (!vb->discard || vb->read_only) {
+        return true;
+    }
+
+    uint32_t range = 0;
+    uint32_t offset = 0;
+    while (range < count) {
+        uint32_t n = 0;
+        while (n < vb->max_discard_seg && range < count) {
+            if (offset >= ranges[range].count) {
+                range++;
+                offset = 0;
+                continue;
+            }
+            uint32_t chunk = ranges[range].count - offset;
+            if (chunk > vb->max_discard_sectors) {
+                chunk = vb->max_discard_sectors;
+            }
+            segs[n].sector = ranges[range].lba + offset;
+            segs[n].num_sectors = chunk;
+            segs[n].flags = 0;
+            offset += chunk;
+            n++;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        blockdev_request_t req;
+        memset(&req, 0, sizeof(req));
+        uint32_t slot_index = virtio_blk_alloc_slot(vb);
+        vb->slots[slot_index].req = &req;
+        vb->slots[slot_index].flush_after = false;
+        if (!virtio_blk_publish(vb, slot_index, VIRTIO_BLK_T_DISCARD, 0, segs,
+                                n * sizeof(virtio_blk_discard_t))) {
+            vb->slots[slot_index].req = NULL;
+            return false;
+        }
+        vb->busy |= 1ull << slot_index;
+        virtio_blk_notify(vb);
+        while (!req.done) {
+            virtio_blk_reap(vb);
+        }
+        if (!req.success) {
+            vga_writestr("virtio Error: Discard failed\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static const blockdev_ops_t virtio_blk_ops = {
+    .read = virtio_blk_read,
+    .write = virtio_blk_write,
+    .flush = virtio_blk_flush,
+    .submit = virtio_blk_submit,
+    .poll = virtio_blk_poll,
+    .commit = virtio_blk_commit,
+    .discard = virtio_blk_discard,
+};
+
+static bool virtio_blk_probe(pci_device_t* pci) {
+    if (virtio_blk_count >= VIRTIO_BLK_MAX_DEVICES) {
+        return false;
+    }
+
+    virtio_blk_t* vb = &virtio_blk_devices[virtio_blk_count];
+    if (!pci->bars[0].io || pci->bars[0].base == 0) {
+        vga_writestr("virtio Error: BAR0 is not an I/O port range\n");
+        return false;
+    }
+    memset(vb, 0, sizeof(*vb));
+    vb->io_base = (uint16_t)pci->bars[0].base;
+    pci_enable_device(pci, true);
+
+    // Reset, then announce a driver
+    uint16_t io = vb->io_base;
+    outb(io + VIRTIO_REG_STATUS, 0);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl(io + VIRTIO_REG_DEVICE_FEATURES);
+    features &= VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_BLK_F_FLUSH |
+                VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_DISCARD;
+    outl(io + VIRTIO_REG_GUEST_FEATURES, features);
+    vb->indirect = (features & VIRTIO_RING_F_INDIRECT_DESC) != 0;
+    vb->flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+    vb->read_only = (features & VIRTIO_BLK_F_RO) != 0;
+
+    uint32_t cfg = io + VIRTIO_REG_CONFIG;
+    if (features & VIRTIO_BLK_F_SIZE_MAX) {
+        // Whole-sector segments where the device allows them
+        vb->size_max = inl(cfg + VIRTIO_BLK_CFG_SIZE_MAX);
+        if (vb->size_max >= 512) {
+            vb->size_max &= ~511u;
+        }
+    }
+
+    // Keep requests within the segments a slot can describe
+    vb->dev.max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (vb->size_max) {
+        uint32_t max_sectors = vb->size_max >= 512 ? vb->size_max / 512 * VIRTIO_BLK_SEGMENTS :
+                                                     vb->size_max * VIRTIO_BLK_SEGMENTS / 512;
+        if (max_sectors < vb->dev.max_sectors) {
+            vb->dev.max_sectors = max_sectors;
+        }
+    }
+    if (vb->dev.max_sectors == 0) {
+        vga_writestr("virtio Error: Segment size too small\n");
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    if (features & VIRTIO_BLK_F_DISCARD) {
+        vb->max_discard_sectors = inl(cfg + VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS);
+        vb->max_discard_seg = inl(cfg + VIRTIO_BLK_CFG_MAX_DISCARD_SEG);
+        if (vb->max_discard_seg > VIRTIO_BLK_DISCARD_SEGS) {
+            vb->max_discard_seg = VIRTIO_BLK_DISCARD_SEGS;
+        }
+        vb->discard = vb->max_discard_sectors && vb->max_discard_seg;
+    }
+
+    outw(io + VIRTIO_REG_QUEUE_SELECT, 0);
+    vb->queue_size = inw(io + VIRTIO_REG_QUEUE_SIZE);
+    if (vb->queue_size == 0) {
+        vga_writestr("virtio Error: No request queue\n");
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    uint8_t* ring = kmalloc_aligned(virtq_total_size(vb->queue_size), VIRTQ_ALIGN);
+    vb->descs_per_slot = vb->indirect ? 1 : VIRTIO_BLK_SEGMENTS + 2;
+    vb->slot_count = vb->queue_size / vb->descs_per_slot;
+    if (vb->slot_count > VIRTIO_BLK_SLOTS) {
+        vb->slot_count = VIRTIO_BLK_SLOTS;
+    }
+    vb->slots = kmalloc_aligned(vb->slot_count * sizeof(virtio_blk_slot_t), 16);
+    if (!ring || !vb->slots || vb->slot_count == 0) {
+        vga_writestr("virtio Error: Out of memory\n");
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    memset(ring, 0, virtq_total_size(vb->queue_size));
+    memset(vb->slots, 0, vb->slot_count * sizeof(virtio_blk_slot_t));
+
+    vb->desc = (virtq_desc_t*)ring;
+    vb->avail = (virtq_avail_t*)(ring + sizeof(virtq_desc_t) * vb->queue_size);
+    vb->used = (virtq_used_t*)(ring + virtq_used_offset(vb->queue_size));
+    vb->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;     // Completions are polled
+    outl(io + VIRTIO_REG_QUEUE_PFN, (uint32_t)ring / VIRTQ_ALIGN);
+
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                 VIRTIO_STATUS_DRIVER_OK);
+
+    strcpy(vb->dev.name, "virtio0");
+    vb->dev.name[6] = '0' + virtio_blk_count;
+    vb->dev.sector_size = 512;
+    vb->dev.sector_count = (uint64_t)inl(cfg + VIRTIO_BLK_CFG_CAPACITY) |
+                           ((uint64_t)inl(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    vb->dev.ops = &virtio_blk_ops;
+    vb->dev.driver_data = vb;
+
+    if (!blockdev_register(&vb->dev)) {
+        return false;
+    }
+
+    virtio_blk_count++;
+    return true;
+}
+
+static const pci_device_id_t virtio_blk_ids[] = {
+    { VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, PCI_ANY_ID },
+    { 0, 0, 0 },
+};
+
+static pci_driver_t virtio_blk_driver = {
+    .name = "virtio-blk",
+    .ids = virtio_blk_ids,
+    .probe = virtio_blk_probe,
+};
+
+int virtio_blk_init(void) {
+    pci_register_driver(&virtio_blk_driver);
+    return virtio_blk_count;
+}
@@ -0,0 +1,135 @@
+#ifndef RINGOS_AHCI_H
+#define RINGOS_AHCI_H
+
+#include "types.h"
+
+// PCI class of an AHCI controller, the ABAR is BAR5
+#define AHCI_PCI_CLASS      0x01
+#define AHCI_PCI_SUBCLASS   0x06
+
+#define AHCI_MAX_PORTS      32
+#define AHCI_MAX_DEVICES    4
+#define AHCI_MAX_SLOTS      32
+
+// Generic host control registers (offsets from the ABAR)
+#define AHCI_HBA_CAP        0x00    // Host capabilities
+#define AHCI_HBA_GHC        0x04    // Global host control
+#define AHCI_HBA_IS         0x08    // Interrupt status
+#define AHCI_HBA_PI         0x0C    // Ports implemented
+#define AHCI_HBA_VS         0x10    // Version
+
+// Host capability bits
+#define AHCI_CAP_S64A       (1u << 31)  // 64-bit addressing
+#define AHCI_CAP_SNCQ       (1u << 30)  // Native command queuing
+#define AHCI_CAP_NCS_SHIFT  8           // Command slots - 1, 5 bits
+
+// Global host control bits
+#define AHCI_GHC_HR         (1u << 0)   // HBA reset
+#define AHCI_GHC_IE         (1u << 1)   // Interrupt enable
+#define AHCI_GHC_AE         (1u << 31)  // AHCI enable
+
+// Port registers (offsets from the port base)
+#define AHCI_PORT_BASE      0x100
+#define AHCI_PORT_SIZE      0x80
+#define AHCI_PxCLB          0x00    // Command list base
+#define AHCI_PxCLBU         0x04
+#define AHCI_PxFB           0x08    // FIS receive area base
+#define AHCI_PxFBU          0x0C
+#define AHCI_PxIS           0x10    // Interrupt status
+#define AHCI_PxIE           0x14    // Interrupt enable
+#define AHCI_PxCMD          0x18    // Command and status
+#define AHCI_PxTFD          0x20    // Task file data
+#define AHCI_PxSIG          0x24    // Device signature
+#define AHCI_PxSSTS         0x28    // SATA status
+#define AHCI_PxSCTL         0x2C    // SATA control
+#define AHCI_PxSERR         0x30    // SATA error
+#define AHCI_PxSACT         0x34    // Active NCQ tags
+#define AHCI_PxCI           0x38    // Commands issued
+
+// Port command bits
+#define AHCI_PxCMD_ST       (1u << 0)   // Start processing the command list
+#define AHCI_PxCMD_SUD      (1u << 1)   // Spin up device
+#define AHCI_PxCMD_POD      (1u << 2)   // Power on device
+#define AHCI_PxCMD_FRE      (1u << 4)   // FIS receive enable
+#define AHCI_PxCMD_FR       (1u << 14)  // FIS receive running
+#define AHCI_PxCMD_CR       (1u << 15)  // Command list running
+
+// Port interrupt status bits
+#define AHCI_PxIS_TFES      (1u << 30)  // Task file error
+#define AHCI_PxIS_HBFS      (1u << 29)  // Host bus fatal error
+#define AHCI_PxIS_HBDS      (1u << 28)  // Host bus data error
+#define AHCI_PxIS_IFS       (1u << 27)  // Interface fatal error
+#define AHCI_PxIS_ERRORS    (AHCI_PxIS_TFES | AHCI_PxIS_HBFS | AHCI_PxIS_HBDS | AHCI_PxIS_IFS)
+
+// SATA status: device present with phy communication, interface active
+#define AHCI_SSTS_DET_MASK  0x0F
+#define AHCI_SSTS_DET_OK    0x03
+#define AHCI_SSTS_IPM_SHIFT 8
+#define AHCI_SSTS_IPM_ACTIVE 0x01
+
+// Signature of a plain SATA disk
+#define AHCI_SIG_ATA        0x00000101
+
+// Frame information structure types
+#define AHCI_FIS_REG_H2D    0x27
+
+// Commands issued through the FIS
+#define AHCI_CMD_IDENTIFY           0xEC
+#define AHCI_CMD_READ_DMA_EXT       0x25
+#define AHCI_CMD_WRITE_DMA_EXT      0x35
+#define AHCI_CMD_WRITE_DMA_FUA_EXT  0x3D
+#define AHCI_CMD_FLUSH_CACHE_EXT    0xEA
+#define AHCI_CMD_READ_FPDMA         0x60
+#define AHCI_CMD_WRITE_FPDMA        0x61
+#define AHCI_CMD_DSM                0x06    // DATA SET MANAGEMENT
+
+// Device register bits in the FIS
+#define AHCI_DEV_LBA        0x40
+#define AHCI_DEV_FUA        0x80    // FPDMA write forced unit access
+
+// Transfer limits. A PRD entry covers up to 4 MiB, so eight of them cover
+// the 65536 sectors a 16-bit count can ask for.
+#define AHCI_PRDT_ENTRIES   8
+#define AHCI_PRD_MAX_BYTES  (4 * 1024 * 1024)
+#define AHCI_MAX_SECTORS    65536
+
+// Buffers must be word aligned, odd ones are copied through a per-port
+// bounce buffer of this many sectors
+#define AHCI_BOUNCE_SECTORS 16
+
+#define AHCI_TIMEOUT_MS     5000
+
+// Command header, one per slot in the command list
+typedef struct {
+    uint16_t flags;         // FIS length in dwords, write, prefetchable
+    uint16_t prdtl;         // PRD entries in the command table
+    volatile uint32_t prdbc;// Bytes transferred
+    uint32_t ctba;          // Command table base, 128-byte aligned
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+// Command header flag bits
+#define AHCI_CMDH_CFL_H2D   5           // Register H2D FIS is 5 dwords
+#define AHCI_CMDH_WRITE     (1u << 6)
+#define AHCI_CMDH_PREFETCH  (1u << 7)
+#define AHCI_CMDH_CLEAR     (1u << 10)  // Clear busy on R_OK
+
+typedef struct {
+    uint32_t dba;           // Data base, word aligned
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;           // Byte count - 1, bit 31 interrupts on completion
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+// Returns the number of disks registered as block devices ahci0, ahci1, ...
+int ahci_init(void);
+
+#endif /* RINGOS_AHCI_H */
@@ -2,18 +2,73 @@
 #define RINGOS_ATA_H
 
 #include "types.h"
+#include "blockdev.h"
 
-// ATA registers
-#define ATA_DATA        0x1F0   // Read/Write PIO data bytes
-#define ATA_ERROR       0x1F1   // Read error register
-#define ATA_FEATURES    0x1F1   // Write features
-#define ATA_SECCOUNT0   0x1F2   // Number of sectors to read/write
-#define ATA_SECTOR      0x1F3   // Sector address LBA 0-7
-#define ATA_LCYL        0x1F4   // Cylinder low / LBA 8-15
-#define ATA_HCYL        0x1F5   // Cylinder high / LBA 16-23
-#define ATA_DRIVEHEAD   0x1F6   // Drive/Head / LBA 24-27
-#define ATA_STATUS      0x1F7   // Read status
-#define ATA_COMMAND     0x1F7   // Write command
+// Legacy channel ports. Each channel has a master and a slave drive,
+// numbered ata0/ata1 on the primary and ata2/ata3 on the secondary.
+#define ATA_PRIMARY_IO      0x1F0
+#define ATA_PRIMARY_CTRL    0x3F6
+#define ATA_SECONDARY_IO    0x170
+#define ATA_SECONDARY_CTRL  0x376
+#define ATA_CHANNELS        2
+#define ATA_DRIVES          4
+
+// ATA registers (offsets from the channel's I/O base)
+#define ATA_DATA        0x00    // Read/Write PIO data bytes
+#define ATA_ERROR       0x01    // Read error register
+#define ATA_FEATURES    0x01    // Write features
+#define ATA_SECCOUNT0   0x02    // Number of sectors to read/write
+#define ATA_SECTOR      0x03    // Sector address LBA 0-7
+#define ATA_LCYL        0x04    // Cylinder low / LBA 8-15
+#define ATA_HCYL        0x05    // Cylinder high / LBA 16-23
+#define ATA_DRIVEHEAD   0x06    // Drive/Head / LBA 24-27
+#define ATA_STATUS      0x07    // Read status
+#define ATA_COMMAND     0x07    // Write command
+
+// Control block registers (offsets from the channel's control port)
+#define ATA_ALTSTATUS   0x00    // Read alternate status (does not ack IRQ)
+#define ATA_CONTROL     0x00    // Write device control
+
+// Device control bits
+#define ATA_CTRL_NIEN   0x02    // Disable device interrupts
+#define ATA_CTRL_SRST   0x04    // Software reset of both drives
+
+// Drive/head register bits
+#define ATA_DH_SLAVE    0x10
+
+// Signature an ATAPI device leaves in LCYL/HCYL after IDENTIFY aborts
+#define ATA_ATAPI_LCYL  0x14
+#define ATA_ATAPI_HCYL  0xEB
+
+// Addressing limits
+#define ATA_LBA28_LIMIT        0x10000000  // First sector LBA28 cannot reach
+#define ATA_LBA28_MAX_SECTORS  256
+#define ATA_LBA48_MAX_SECTORS  65536
+// Worst case every PRD entry but one is a full 64 KiB
+#define ATA_DMA_MAX_SECTORS    ((ATA_PRDT_ENTRIES - 1) * 128)
+
+// Command timeout, and spin bound for polling with interrupts off
+#define ATA_TIMEOUT_MS  5000
+#define ATA_POLL_SPINS  1000000
+
+// Bus master IDE registers (offsets from BAR4 of the IDE controller)
+#define ATA_BM_COMMAND  0x00    // Start/stop and transfer direction
+#define ATA_BM_STATUS   0x02    // Active, error and interrupt flags
+#define ATA_BM_PRDT     0x04    // Physical address of the PRD table
+#define ATA_BM_SECONDARY 0x08   // Secondary channel registers follow the primary
+
+// Bus master command bits
+#define ATA_BM_CMD_START 0x01   // Start bus master transfer
+#define ATA_BM_CMD_READ  0x08   // Device to memory
+
+// Bus master status bits
+#define ATA_BM_SR_ACTIVE 0x01   // Transfer in progress
+#define ATA_BM_SR_ERR    0x02   // DMA error
+#define ATA_BM_SR_IRQ    0x04   // Device raised its interrupt
+
+// Physical region descriptor flags
+#define ATA_PRD_EOT      0x8000 // Last entry in the table
+#define ATA_PRDT_ENTRIES 512    // One 4 KiB page worth of descriptors
 
 // Status register bits
 #define ATA_SR_BSY      0x80    // Busy
@@ -34,11 +89,33 @@
 #define ATA_CMD_WRITE_PIO_EXT     0x34
 #define ATA_CMD_WRITE_DMA         0xCA
 #define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
 #define ATA_CMD_CACHE_FLUSH       0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT   0xEA
 #define ATA_CMD_PACKET            0xA0
 #define ATA_CMD_IDENTIFY_PACKET   0xA1
 #define ATA_CMD_IDENTIFY          0xEC
+#define ATA_CMD_SET_FEATURES      0xEF
+#define ATA_CMD_DSM               0x06    // DATA SET MANAGEMENT
+
+// SET FEATURES subcommand and transfer mode values
+#define ATA_FEATURE_XFER_MODE     0x03
+#define ATA_XFER_PIO              0x08    // | PIO mode number
+#define ATA_XFER_MWDMA            0x20    // | multiword DMA mode number
+#define ATA_XFER_UDMA             0x40    // | Ultra DMA mode number
+
+// DATA SET MANAGEMENT: the TRIM payload is 512-byte blocks of 64
+// entries, each a 48-bit LBA and a 16-bit sector count
+#define ATA_DSM_TRIM              0x01
+#define ATA_TRIM_ENTRIES          64
+#define ATA_TRIM_RANGE_MAX        0xFFFF
+#define ATA_TRIM_MAX_BLOCKS       8
 
 // IDENTIFY command response offsets
 #define ATA_IDENT_DEVICETYPE   0
@@ -47,16 +124,72 @@
 #define ATA_IDENT_SECTORS      12
 #define ATA_IDENT_SERIAL       20
 #define ATA_IDENT_MODEL        54
+#define ATA_IDENT_MAX_MULTIPLE 94
+#define ATA_IDENT_DWORD_IO     96
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID   106
+#define ATA_IDENT_MULTIPLE     118
 #define ATA_IDENT_MAX_LBA      120
+#define ATA_IDENT_MWDMA        126
+#define ATA_IDENT_PIO_MODES    128
 #define ATA_IDENT_COMMANDSETS  164
+#define ATA_IDENT_ENABLED      170
+#define ATA_IDENT_UDMA         176
 #define ATA_IDENT_MAX_LBA_EXT  200
+#define ATA_IDENT_DSM_BLOCKS   210
+#define ATA_IDENT_DSM          338
+
+// Write flags
+#define ATA_WRITE_FUA   0x01    // Forced unit access: durable on return
+
+// Physical region descriptor, one per contiguous chunk of a DMA buffer
+typedef struct {
+    uint32_t base;
+    uint16_t byte_count;    // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) ata_prd_t;
+
+// Parsed IDENTIFY data, plus the transfer mode chosen at init
+typedef struct {
+    char model[41];
+    char serial[21];
+    uint64_t sectors;
+    bool lba48;
+    uint16_t max_multiple;      // Largest DRQ block for READ/WRITE MULTIPLE
+    bool pio32;                 // Data port may be read 32 bits at a time
+
+    // Supported modes, bit n set for mode n
+    uint8_t pio_modes;
+    uint8_t mwdma_modes;
+    uint8_t udma_modes;
+
+    bool write_cache;
+    bool write_cache_enabled;
+    bool flush;
+    bool flush_ext;
+    bool fua;
+    bool trim;
+    uint16_t trim_max_blocks;   // Payload blocks per DATA SET MANAGEMENT
+
+    bool dma;                   // Transfers use bus master DMA
+    uint8_t xfer_mode;          // ATA_XFER_* | mode number
+} ata_device_info_t;
+
+// Function prototypes. Drives are addressed by position 0-3, the
+// number in their block device name.
+int ata_init(void);
+bool ata_read_sectors(int drive, uint64_t lba, uint32_t sector_count, void* buffer);
+bool ata_write_sectors(int drive, uint64_t lba, uint32_t sector_count, const void* buffer);
+bool ata_write_sectors_flags(int drive, uint64_t lba, uint32_t sector_count, const void* buffer, uint32_t flags);
+bool ata_flush(int drive);
+bool ata_dma_enabled(int drive);
+uint16_t ata_multiple_sectors(int drive);
+const ata_device_info_t* ata_get_info(int drive);   // NULL if no drive there
+void ata_set_dma_enabled(bool enabled);
 
-// Function prototypes
-bool ata_init(void);
-bool ata_identify(void);
-bool ata_read_sectors(uint32_t lba, uint8_t sector_count, void* buffer);
-bool ata_write_sectors(uint32_t lba, uint8_t sector_count, const void* buffer);
+// Shared with AHCI: pack ranges into TRIM entries from *range/*offset on,
+// returns the entries written
+uint32_t ata_trim_pack(uint64_t* entries, uint32_t max_entries, const blockdev_range_t* ranges,
+                       uint32_t count, uint32_t* range, uint32_t* offset);
 
 #endif /* RINGOS_ATA_H */
\ No newline at end of file
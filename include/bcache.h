@@ -0,0 +1,83 @@
+#ifndef RINGOS_BCACHE_H
+#define RINGOS_BCACHE_H
+
+#include "types.h"
+#include "blockdev.h"
+
+// Sector cache between the filesystem and the block devices
+#define BCACHE_BLOCK_SIZE       512
+#define BCACHE_DEFAULT_BUFFERS  256     // 128 KiB
+#define BCACHE_HASH_SIZE        256     // Power of two
+
+// Write-back: dirty sectors older than this go out from bcache_tick,
+// adjacent ones merged into writes of up to BCACHE_COALESCE_SECTORS
+#define BCACHE_WRITEBACK_MS     5000
+#define BCACHE_COALESCE_SECTORS 128
+
+typedef struct bcache_buf {
+    blockdev_t* dev;
+    uint64_t lba;
+    uint8_t* data;
+    uint32_t pins;              // Pinned buffers are never evicted
+    bool valid;
+    bool dirty;                 // Newer than the device, write-back mode only
+
+    struct bcache_buf* hash_next;
+    struct bcache_buf* lru_prev;    // Towards the most recently used
+    struct bcache_buf* lru_next;
+} bcache_buf_t;
+
+typedef struct {
+    uint32_t buffers;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t dirty;
+    uint32_t writebacks;        // Device writes issued for dirty sectors
+    uint32_t written;           // Dirty sectors written
+    uint32_t prefetched;        // Sectors read ahead by bcache_readahead
+} bcache_stats_t;
+
+// Called once at boot, later calls are ignored. Without it the first
+// use sets up BCACHE_DEFAULT_BUFFERS.
+bool bcache_init(uint32_t buffers);
+
+// Pin a sector, reading it on a miss. NULL on I/O error or when every
+// buffer is pinned. Release with bcache_put.
+bcache_buf_t* bcache_get(blockdev_t* dev, uint64_t lba);
+void bcache_put(bcache_buf_t* buf);
+
+// Copy a sector out of or into the cache. In write-through mode, and
+// for BLOCKDEV_WRITE_FUA, writes reach the device before returning.
+// In write-back mode the sector is only marked dirty.
+bool bcache_read(blockdev_t* dev, uint64_t lba, void* buffer);
+bool bcache_write(blockdev_t* dev, uint64_t lba, const void* buffer, uint32_t flags);
+
+// Read the uncached sectors from lba on with a single command, stopping
+// at the first one already cached. Only a hint, errors are ignored.
+void bcache_readahead(blockdev_t* dev, uint64_t lba, uint32_t count);
+
+// Drop cached copies of sectors written around the cache, dirty or not
+void bcache_invalidate(blockdev_t* dev, uint64_t lba, uint32_t count);
+
+// Write-back control. bcache_sync writes every dirty sector of dev (all
+// devices for NULL) and flushes the device caches. bcache_tick runs the
+// periodic flusher and is called from the idle loop.
+void bcache_set_writeback(bool enabled);
+
+// Called before sectors of dev, or of every device for NULL, are written
+// back or written through, so a filesystem can write what they point at
+// first. Nothing is written if it fails.
+void bcache_set_writeback_hook(bool (*hook)(blockdev_t* dev));
+bool bcache_writeback_enabled(void);
+bool bcache_sync(blockdev_t* dev);
+void bcache_tick(void);
+
+// Write back the dirty sectors of dev in lba .. lba + count - 1 only,
+// without the hook or a device cache flush
+bool bcache_writeback_range(blockdev_t* dev, uint64_t lba, uint32_t count);
+
+const bcache_stats_t* bcache_get_stats(void);
+void bcache_reset_stats(void);
+
+#endif /* RINGOS_BCACHE_H */
@@ -0,0 +1,148 @@
+#ifndef RINGOS_BLOCKDEV_H
+#define RINGOS_BLOCKDEV_H
+
+#include "types.h"
+
+#define BLOCKDEV_MAX_DEVICES 8
+#define BLOCKDEV_NAME_LEN    8
+
+// Request queue limits
+#define BLOCKDEV_QUEUE_DEPTH        64      // Pending requests before a forced dispatch
+#define BLOCKDEV_POOL_SIZE          64      // Requests for blockdev_queue_write
+#define BLOCKDEV_MAX_MERGE_SECTORS  65536
+
+// Request types
+#define BLOCKDEV_OP_READ     0
+#define BLOCKDEV_OP_WRITE    1
+#define BLOCKDEV_OP_FLUSH    2
+#define BLOCKDEV_OP_DISCARD  3
+
+// Write flags
+#define BLOCKDEV_WRITE_FUA   0x01    // Durable before completion
+
+// Statistics: latency buckets are log2 of TSC cycles, depth buckets
+// log2 of the requests in flight when a command is issued
+#define BLOCKDEV_OP_COUNT       4
+#define BLOCKDEV_LAT_BUCKETS    32
+#define BLOCKDEV_DEPTH_BUCKETS  8
+
+struct blockdev;
+
+// Sector range for discard
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+} blockdev_range_t;
+
+typedef struct {
+    uint32_t ops[BLOCKDEV_OP_COUNT];        // Commands issued to the driver
+    uint64_t sectors[BLOCKDEV_OP_COUNT];
+    uint32_t merges;                        // Requests folded into another command
+    uint32_t errors;
+    uint32_t latency[BLOCKDEV_OP_COUNT][BLOCKDEV_LAT_BUCKETS];
+    uint32_t depth[BLOCKDEV_DEPTH_BUCKETS];
+    uint32_t max_depth;
+} blockdev_stats_t;
+
+typedef struct blockdev_request {
+    uint8_t op;
+    uint32_t flags;
+    uint64_t lba;
+    uint32_t count;             // Sectors
+    void* buffer;
+
+    // Completion, filled in by blockdev_complete()
+    volatile bool done;
+    bool success;
+    void (*callback)(struct blockdev_request* req);
+    void* private_data;
+
+    // Queue bookkeeping, owned by the block layer
+    struct blockdev_request* next;
+    bool pooled;
+    struct blockdev* dev;               // Set while counted in dev->inflight
+    struct blockdev_request* merged;    // Requests carried by a merged command
+    uint64_t issued;                    // TSC when handed to the driver
+} blockdev_request_t;
+
+typedef struct {
+    bool (*read)(struct blockdev* dev, uint64_t lba, uint32_t count, void* buffer);
+    bool (*write)(struct blockdev* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags);
+    bool (*flush)(struct blockdev* dev);
+    // Optional. Start a request and call blockdev_complete() when done,
+    // also when it fails to start.
+    bool (*submit)(struct blockdev* dev, blockdev_request_t* req);
+    // Optional. Reap finished requests of a submit driver.
+    void (*poll)(struct blockdev* dev);
+    // Optional. Start everything submitted so far, called once per batch.
+    void (*commit)(struct blockdev* dev);
+    // Optional. Tell the device the ranges no longer hold data.
+    bool (*discard)(struct blockdev* dev, const blockdev_range_t* ranges, uint32_t count);
+} blockdev_ops_t;
+
+typedef struct blockdev {
+    char name[BLOCKDEV_NAME_LEN];
+    uint32_t sector_size;
+    uint64_t sector_count;
+    const blockdev_ops_t* ops;
+    void* driver_data;
+    uint32_t max_sectors;       // Largest request ops->submit takes, 0 for no limit
+
+    // Pending requests sorted by LBA, dispatched C-LOOK on unplug
+    blockdev_request_t* queue;
+    uint32_t queue_len;
+    int plug_depth;
+    bool queue_error;
+    uint64_t head_lba;
+
+    // Requests handed to ops->submit that have not completed yet, and
+    // how many of those are writes or flushes
+    volatile uint32_t inflight;
+    volatile uint32_t inflight_writes;
+
+    blockdev_stats_t stats;
+} blockdev_t;
+
+// Registry
+bool blockdev_register(blockdev_t* dev);
+blockdev_t* blockdev_get(const char* name);
+blockdev_t* blockdev_get_index(int index);
+int blockdev_count(void);
+
+// Synchronous I/O
+bool blockdev_read(blockdev_t* dev, uint64_t lba, uint32_t count, void* buffer);
+bool blockdev_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer);
+bool blockdev_write_flags(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags);
+bool blockdev_flush(blockdev_t* dev);
+
+// Discard is a hint: devices without support ignore it and reads of
+// discarded sectors may return old data or zeroes
+bool blockdev_can_discard(blockdev_t* dev);
+
+// Largest request a device takes in one command. Merges stay within it,
+// callers of the asynchronous interface must too.
+uint32_t blockdev_max_sectors(blockdev_t* dev);
+bool blockdev_discard(blockdev_t* dev, const blockdev_range_t* ranges, uint32_t count);
+
+// Request interface. While a device is plugged, submitted requests are
+// held back, sorted and merged, then dispatched together on unplug.
+// Buffers of queued requests must stay valid until then. Drivers with a
+// submit hook may finish requests out of order, unplug waits for them.
+void blockdev_plug(blockdev_t* dev);
+bool blockdev_unplug(blockdev_t* dev);
+bool blockdev_queue_write(blockdev_t* dev, uint64_t lba, uint32_t count, const void* buffer, uint32_t flags);
+bool blockdev_submit(blockdev_t* dev, blockdev_request_t* req);
+void blockdev_complete(blockdev_request_t* req, bool success);
+bool blockdev_wait(blockdev_request_t* req);
+void blockdev_drain(blockdev_t* dev);
+
+// Asynchronous I/O on caller-owned requests. The callback runs from
+// blockdev_complete, possibly before this returns. Several requests may
+// be in flight; wait for each with blockdev_wait.
+bool blockdev_read_async(blockdev_t* dev, blockdev_request_t* req, uint64_t lba, uint32_t count,
+                         void* buffer, void (*callback)(blockdev_request_t* req), void* private_data);
+
+// Statistics
+void blockdev_stats_reset(blockdev_t* dev);
+
+#endif /* RINGOS_BLOCKDEV_H */
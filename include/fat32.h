@@ -2,6 +2,7 @@
 #define RINGOS_FAT32_H
 
 #include "types.h"
+#include "blockdev.h"
 
 // FAT32 specific constants
 #define SECTOR_SIZE 512
@@ -63,6 +64,51 @@ typedef struct {
     uint32_t file_size;
 } __attribute__((packed)) fat32_dir_entry_t;
 
+// Extent maps cached for recently read files, and extents per map.
+// Lookups past a full map walk the FAT from its last extent.
+#define FAT32_EXTENT_MAPS 8
+#define FAT32_EXTENT_MAX  32
+
+// FSInfo sector: free cluster count and next-free hint
+#define FAT32_FSINFO_LEAD_SIG   0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FSINFO_TRAIL_SIG  0xAA550000
+#define FAT32_FSINFO_UNKNOWN    0xFFFFFFFF
+
+typedef struct {
+    uint32_t lead_signature;
+    uint8_t  reserved1[480];
+    uint32_t struct_signature;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t  reserved2[12];
+    uint32_t trail_signature;
+} __attribute__((packed)) fat32_fsinfo_t;
+
+// A run of consecutive clusters within a file
+typedef struct {
+    uint32_t file_cluster;      // Index of the first cluster within the file
+    uint32_t cluster;           // First cluster on disk
+    uint32_t count;
+} fat32_extent_t;
+
+typedef struct {
+    uint32_t first_cluster;     // 0 for an unused map
+    uint32_t count;             // Extents mapped so far
+    bool complete;              // The whole chain is mapped
+    uint32_t last_used;
+    fat32_extent_t extents[FAT32_EXTENT_MAX];
+} fat32_extent_map_t;
+
+// An open file: its directory entry, where that lives, and its extents
+typedef struct fat32_file {
+    fat32_dir_entry_t entry;
+    uint32_t entry_sector;
+    uint32_t entry_index;
+    fat32_extent_map_t map;
+    struct fat32_file* next;    // Open files, owned by fat32.c
+} fat32_file_t;
+
 typedef struct {
     uint32_t cluster;
     char name[12];
@@ -71,6 +117,7 @@ typedef struct {
 
 // Function prototypes
 bool fat32_init(void);
+bool fat32_mount(blockdev_t* dev);
 bool fat32_read_boot_sector(fat32_boot_sector_t* boot_sector);
 bool fat32_read_root_directory(void);
 bool fat32_find_file(const char* name, fat32_dir_entry_t* entry);
@@ -80,8 +127,22 @@ bool fat32_delete_file(const char* name);
 bool fat32_list_directory(void (*callback)(const char* name, uint32_t size, uint8_t attr));
 bool fat32_create_directory(const char* name);
 bool fat32_init_directory_structure(void);
+// Replace a file's contents in place, freeing only clusters past the end
 bool fat32_write_file(const char* name, const void* data, uint32_t size);
 bool fat32_read_file(const char* name, void* buffer, uint32_t* size);
+// Read *length bytes at offset, *length is set to the bytes read
+bool fat32_read_range(uint32_t first_cluster, uint32_t file_size, uint32_t offset,
+                      void* buffer, uint32_t* length);
+
+// Open files in the current directory, by plain name. The caller owns
+// the fat32_file_t and keeps it until fat32_close.
+bool fat32_open(const char* name, bool create, fat32_file_t* file);
+void fat32_close(fat32_file_t* file);
+bool fat32_read_at(fat32_file_t* file, uint32_t offset, void* buffer, uint32_t* length);
+bool fat32_write_at(fat32_file_t* file, uint32_t offset, const void* data, uint32_t length);
+bool fat32_append(fat32_file_t* file, const void* data, uint32_t length);
+// Shrinking frees the clusters past the new end, growing zero-fills
+bool fat32_truncate(fat32_file_t* file, uint32_t size);
 bool fat32_free_clusters(uint32_t first_cluster);
 uint32_t fat32_allocate_cluster(void);
 bool fat32_write_fat_entry(uint32_t cluster, uint32_t value);
@@ -89,9 +150,30 @@ bool fat32_change_directory(const char* dirname);
 uint32_t fat32_get_current_directory(void);
 const char* fat32_get_current_path(void);
 bool fat32_is_directory(const fat32_dir_entry_t* entry);
+void fat32_set_discard(bool enabled);
+bool fat32_sync(void);
+void fat32_tick(void);
 
 // Add these helper macros
 #define FAT32_EOC 0x0FFFFFF8  // End of chain marker
 #define FAT32_FREE_CLUSTER 0x00000000
 
+// Freed cluster ranges sent to the device per discard
+#define FAT32_DISCARD_BATCH 64
+
+// Read-ahead for file reads. The window, in clusters per request, doubles
+// while a file is contiguous on disk and halves at fragment breaks.
+#define FAT32_READAHEAD_MIN   2
+#define FAT32_READAHEAD_MAX   64
+#define FAT32_READAHEAD_REQS  8     // Requests in flight
+
+// Free runs a growing file looks at for one long enough for the data
+#define FAT32_EXTENT_TRIES    8
+
+// Zeroes written at once when a file grows past a gap, in sectors
+#define FAT32_ZERO_SECTORS    64
+
+// Largest FAT read or write issued at once, in sectors
+#define FAT32_FAT_IO_SECTORS  128
+
 #endif /* RINGOS_FAT32_H */
@@ -10,7 +10,29 @@ struct registers_t {
     uint32_t eip, cs, eflags, useresp, ss;
 };
 
+// Hardware IRQs are remapped above the CPU exceptions
+#define IRQ_BASE 0x20
+#define IRQ_COUNT 16
+
+#define IRQ_TIMER 0
+#define IRQ_CASCADE 2
+#define IRQ_ATA_PRIMARY 14
+#define IRQ_ATA_SECONDARY 15
+
+typedef void (*irq_handler_t)(struct registers_t* regs);
+
 void init_idt();
 void set_idt_gate(int num, uint32_t base, uint16_t sel, uint8_t flags);
+void irq_install_handler(int irq, irq_handler_t handler);
+void pic_unmask_irq(int irq);
+void pic_mask_irq(int irq);
+void pic_send_eoi(int irq);
+bool pic_is_spurious(int irq);
+
+static inline bool interrupts_enabled(void) {
+    uint32_t flags;
+    asm volatile("pushf\n\tpop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
 
 #endif
@@ -23,6 +23,33 @@ static inline void outw(uint16_t port, uint16_t value) {
     asm volatile("outw %0, %1" : : "a"(value), "Nd"(port));
 }
 
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// String I/O, count is in units of the transfer size
+static inline void insw(uint16_t port, void* addr, uint32_t count) {
+    asm volatile("rep insw" : "+D"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* addr, uint32_t count) {
+    asm volatile("rep outsw" : "+S"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void insl(uint16_t port, void* addr, uint32_t count) {
+    asm volatile("rep insl" : "+D"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsl(uint16_t port, const void* addr, uint32_t count) {
+    asm volatile("rep outsl" : "+S"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
 static inline void io_wait(void) {
     outb(0x80, 0);
 }
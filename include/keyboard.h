@@ -28,5 +28,6 @@ void keyboard_init(void);
 char keyboard_read(void);
 bool keyboard_is_shift_pressed(void);
 bool keyboard_is_caps_on(void);
+bool keyboard_has_data(void);
 
 #endif /* RINGOS_KEYBOARD_H */
\ No newline at end of file
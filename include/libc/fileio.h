@@ -2,25 +2,71 @@
 #define LIBC_FILEIO_H
 
 #include "types.h"
+#include "fat32.h"
+
+#define FS_MAX_OPEN 16
+
+// Open modes
+#define FS_MODE_READ  0
+#define FS_MODE_WRITE 1
+#define FS_MODE_APPEND 2    // Every fs_write goes to the end
+
+// fs_lseek origins
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+
+typedef struct fs_stat {
+    uint32_t size;
+    uint8_t attributes;
+} fs_stat_t;
+
+// Open-file table entry, the index is the file descriptor
+typedef struct {
+    bool used;
+    int mode;
+    uint32_t offset;
+    fat32_file_t file;
+} fs_file_t;
 
 // Initialize the filesystem
-bool fs_init(void);
+// root_device names the block device to mount, NULL picks the first one
+bool fs_init(const char* root_device);
 
-// Open a file
-// Mode: 0 = read, 1 = write
+// Open a file in the current directory
+// Mode: FS_MODE_READ, or FS_MODE_WRITE / FS_MODE_APPEND which create
+// missing files
+// Returns a file descriptor, or -1 on error
 int fs_open(const char* path, int mode);
 
-// Read from a file
-// Returns the number of bytes read, or -1 on error
+// Read from the file position, which moves past the bytes read
+// Returns the number of bytes read, 0 at the end, or -1 on error
 int fs_read(int fd, char* buffer, int size);
 
-// Write to a file
+// Write at the file position, which moves past the bytes written
 // Returns the number of bytes written, or -1 on error
 int fs_write(int fd, const char* buffer, int size);
 
+// Read or write at an offset, leaving the file position alone. Writes
+// past the end fill the gap with zeroes.
+int fs_pread(int fd, char* buffer, int size, uint32_t offset);
+int fs_pwrite(int fd, const char* buffer, int size, uint32_t offset);
+
+// Move the file position, returns the new position or -1
+int fs_lseek(int fd, int offset, int whence);
+
+// Cut the file to size, or grow it with zeroes. Needs a writable fd.
+int fs_ftruncate(int fd, uint32_t size);
+
+// Size and attributes of an open file
+int fs_fstat(int fd, fs_stat_t* st);
+
 // Close a file
 int fs_close(int fd);
 
+// Write every cached change back to the disk
+bool fs_sync(void);
+
 // Change the current directory
 bool fs_chdir(const char* path);
 
@@ -84,4 +84,68 @@ static inline int syscall_close(int fd) {
         : "r"(fd)
         : "eax", "ebx");
     return result;
-}
\ No newline at end of file
+}
+
+static inline int syscall_sync(void) {
+    int result;
+    asm volatile(
+        "mov $0x07, %%eax\n" // Syscall number for sync
+        "int $0x80\n"        // Trigger syscall
+        "mov %%eax, %0\n"    // Save result to 'result'
+        : "=r"(result)
+        :
+        : "eax");
+    return result;
+}
+
+// Four arguments leave too few free registers for "r" operands, these
+// load EAX, EBX, ECX, EDX and ESI through constraints instead
+struct fs_stat;
+
+static inline int syscall_pread(int fd, char* buf, int size, unsigned int offset) {
+    int result;
+    asm volatile(
+        "int $0x80\n"        // Syscall 8, read at an offset
+        : "=a"(result)
+        : "a"(0x08), "b"(fd), "c"(buf), "d"(size), "S"(offset)
+        : "memory");
+    return result;
+}
+
+static inline int syscall_pwrite(int fd, const char* buf, int size, unsigned int offset) {
+    int result;
+    asm volatile(
+        "int $0x80\n"        // Syscall 9, write at an offset
+        : "=a"(result)
+        : "a"(0x09), "b"(fd), "c"(buf), "d"(size), "S"(offset)
+        : "memory");
+    return result;
+}
+
+static inline int syscall_lseek(int fd, int offset, int whence) {
+    int result;
+    asm volatile(
+        "int $0x80\n"        // Syscall 10, move the file position
+        : "=a"(result)
+        : "a"(0x0A), "b"(fd), "c"(offset), "d"(whence));
+    return result;
+}
+
+static inline int syscall_fstat(int fd, struct fs_stat* st) {
+    int result;
+    asm volatile(
+        "int $0x80\n"        // Syscall 11, file size and attributes
+        : "=a"(result)
+        : "a"(0x0B), "b"(fd), "c"(st)
+        : "memory");
+    return result;
+}
+
+static inline int syscall_ftruncate(int fd, unsigned int size) {
+    int result;
+    asm volatile(
+        "int $0x80\n"        // Syscall 12, cut or grow a file
+        : "=a"(result)
+        : "a"(0x0C), "b"(fd), "c"(size));
+    return result;
+}
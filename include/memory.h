@@ -6,6 +6,7 @@
 // Memory allocation functions
 void init_memory(void);
 void* kmalloc(size_t size);
+void* kmalloc_aligned(size_t size, size_t align);
 void kfree(void* ptr);
 
 #endif
\ No newline at end of file
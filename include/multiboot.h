@@ -0,0 +1,34 @@
+#ifndef RINGOS_MULTIBOOT_H
+#define RINGOS_MULTIBOOT_H
+
+#include "types.h"
+
+// Value in EAX when a multiboot loader hands over control
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// multiboot_info_t flags
+#define MULTIBOOT_INFO_MEMORY   0x001
+#define MULTIBOOT_INFO_CMDLINE  0x004
+#define MULTIBOOT_INFO_MODS     0x008
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+#endif /* RINGOS_MULTIBOOT_H */
@@ -0,0 +1,111 @@
+#ifndef RINGOS_PCI_H
+#define RINGOS_PCI_H
+
+#include "types.h"
+
+// Configuration space access ports
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_REVISION        0x08
+#define PCI_PROG_IF         0x09
+#define PCI_SUBCLASS        0x0A
+#define PCI_CLASS           0x0B
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_BAR4            0x20
+#define PCI_BAR5            0x24
+#define PCI_CAP_PTR         0x34
+#define PCI_INTERRUPT_LINE  0x3C
+
+// Command register bits
+#define PCI_CMD_IO          0x0001
+#define PCI_CMD_MEMORY      0x0002
+#define PCI_CMD_BUS_MASTER  0x0004
+
+// Status register bits
+#define PCI_STATUS_CAP_LIST 0x0010
+
+// Capabilities
+#define PCI_CAP_ID_MSI      0x05
+
+// BAR bits
+#define PCI_BAR_IO          0x01
+#define PCI_BAR_TYPE_64     0x04
+#define PCI_BAR_PREFETCH    0x08
+
+#define PCI_MAX_DEVICES     64
+#define PCI_MAX_BARS        6
+#define PCI_ANY_ID          0xFFFF
+
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+} pci_address_t;
+
+// Memory is identity mapped, so a memory BAR's base is usable as a pointer
+typedef struct {
+    uint32_t base;
+    uint32_t size;
+    bool io;
+    bool prefetchable;
+} pci_bar_t;
+
+struct pci_driver;
+
+typedef struct {
+    pci_address_t addr;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t revision;
+    uint8_t irq_line;
+    uint8_t msi_cap;            // Config offset of the MSI capability, 0 if none
+    pci_bar_t bars[PCI_MAX_BARS];
+    struct pci_driver* driver;  // Bound driver, NULL if unclaimed
+} pci_device_t;
+
+// Match on vendor/device, or on class/subclass with PCI_ANY_ID for the
+// IDs. Tables end with an entry whose vendor_id is 0.
+typedef struct {
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t class_id;          // (class << 8) | subclass, or PCI_ANY_ID
+} pci_device_id_t;
+
+typedef struct pci_driver {
+    const char* name;
+    const pci_device_id_t* ids;
+    // Returns true to claim the device
+    bool (*probe)(pci_device_t* dev);
+} pci_driver_t;
+
+uint32_t pci_config_read32(pci_address_t addr, uint8_t offset);
+uint16_t pci_config_read16(pci_address_t addr, uint8_t offset);
+uint8_t pci_config_read8(pci_address_t addr, uint8_t offset);
+void pci_config_write32(pci_address_t addr, uint8_t offset, uint32_t value);
+void pci_config_write16(pci_address_t addr, uint8_t offset, uint16_t value);
+
+// Device table, built by walking every bus/slot/function once
+void pci_init(void);
+int pci_device_count(void);
+pci_device_t* pci_get_device(int index);
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass);
+pci_device_t* pci_find_device(uint16_t vendor, uint16_t device);
+
+// Probe every unclaimed device the driver's ID table matches. Returns
+// the number of devices it claimed.
+int pci_register_driver(pci_driver_t* driver);
+
+// Turn on decoding for the BARs the device has, and optionally DMA
+void pci_enable_device(pci_device_t* dev, bool bus_master);
+
+#endif /* RINGOS_PCI_H */
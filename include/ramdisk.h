@@ -0,0 +1,12 @@
+#ifndef RINGOS_RAMDISK_H
+#define RINGOS_RAMDISK_H
+
+#include "types.h"
+#include "multiboot.h"
+
+#define RAMDISK_MAX_DEVICES 2
+
+bool ramdisk_create(void* base, uint32_t size);
+int ramdisk_init(const multiboot_info_t* mbi);
+
+#endif /* RINGOS_RAMDISK_H */
@@ -0,0 +1,27 @@
+#ifndef RINGOS_TIMER_H
+#define RINGOS_TIMER_H
+
+#include "types.h"
+
+// PIT ports
+#define PIT_CHANNEL0   0x40
+#define PIT_COMMAND    0x43
+#define PIT_BASE_HZ    1193182
+
+// One tick per millisecond
+#define TIMER_HZ       1000
+
+void timer_init(void);
+uint32_t timer_ticks(void);
+
+// Time stamp counter, for measuring intervals below a tick
+static inline uint64_t timer_rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// TSC cycles per millisecond, 0 until it could be measured
+uint32_t timer_tsc_khz(void);
+
+#endif /* RINGOS_TIMER_H */
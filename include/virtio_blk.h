@@ -0,0 +1,106 @@
+#ifndef RINGOS_VIRTIO_BLK_H
+#define RINGOS_VIRTIO_BLK_H
+
+#include "types.h"
+
+// Transitional virtio-blk PCI device, driven through the legacy interface
+#define VIRTIO_PCI_VENDOR       0x1AF4
+#define VIRTIO_PCI_DEVICE_BLK   0x1001
+
+// Legacy I/O registers (offsets from BAR0)
+#define VIRTIO_REG_DEVICE_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES   0x04
+#define VIRTIO_REG_QUEUE_PFN        0x08    // Queue address in 4 KiB pages
+#define VIRTIO_REG_QUEUE_SIZE       0x0C
+#define VIRTIO_REG_QUEUE_SELECT     0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY     0x10
+#define VIRTIO_REG_STATUS           0x12
+#define VIRTIO_REG_ISR              0x13
+#define VIRTIO_REG_CONFIG           0x14    // Device config without MSI-X
+
+// Device config offsets (from VIRTIO_REG_CONFIG)
+#define VIRTIO_BLK_CFG_CAPACITY     0x00    // 512-byte sectors, 64 bits
+#define VIRTIO_BLK_CFG_SIZE_MAX     0x08    // Largest segment in bytes
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS  0x24
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SEG      0x28
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FAILED        0x80
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX       (1u << 1)
+#define VIRTIO_BLK_F_RO             (1u << 5)
+#define VIRTIO_BLK_F_FLUSH          (1u << 9)
+#define VIRTIO_BLK_F_DISCARD        (1u << 13)
+#define VIRTIO_RING_F_INDIRECT_DESC (1u << 28)
+
+// Request types
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_T_FLUSH  4
+#define VIRTIO_BLK_T_DISCARD 11
+
+#define VIRTIO_BLK_S_OK     0
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2   // Device writes this buffer
+#define VIRTQ_DESC_F_INDIRECT   4
+
+// Ring flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
+#define VIRTQ_ALIGN         4096
+
+// Requests in flight, and data segments per request
+#define VIRTIO_BLK_MAX_DEVICES  2
+#define VIRTIO_BLK_SLOTS        64
+#define VIRTIO_BLK_SEGMENTS     14
+#define VIRTIO_BLK_MAX_SECTORS  65536
+#define VIRTIO_BLK_DISCARD_SEGS 32
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;            // Head descriptor of the finished chain
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+// DISCARD payload, one per range
+typedef struct {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __attribute__((packed)) virtio_blk_discard_t;
+
+// Returns the number of devices registered as virtio0, virtio1, ...
+int virtio_blk_init(void);
+
+#endif /* RINGOS_VIRTIO_BLK_H */
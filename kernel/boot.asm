@@ -22,6 +22,10 @@ global _start
 extern kernel_main
 _start:
     mov esp, stack_top ; Set up the stack pointer
+
+    ; kernel_main(magic, multiboot_info), pushed before EAX is reused below
+    push ebx
+    push eax
     
     ; Reset EFLAGS
     push 0
@@ -118,6 +122,59 @@ isr80:
     add esp, 8          ; Remove the interrupt and error code from stack
     iret
 
+; Hardware interrupt stubs, IRQ 0-15 are remapped to vectors 0x20-0x2F
+%macro IRQ 2
+global irq%1
+irq%1:
+    push 0              ; Push dummy error code
+    push %2             ; Push interrupt number
+    jmp irq_common
+%endmacro
+
+IRQ 0, 0x20
+IRQ 1, 0x21
+IRQ 2, 0x22
+IRQ 3, 0x23
+IRQ 4, 0x24
+IRQ 5, 0x25
+IRQ 6, 0x26
+IRQ 7, 0x27
+IRQ 8, 0x28
+IRQ 9, 0x29
+IRQ 10, 0x2A
+IRQ 11, 0x2B
+IRQ 12, 0x2C
+IRQ 13, 0x2D
+IRQ 14, 0x2E
+IRQ 15, 0x2F
+
+irq_common:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    push esp            ; Pass pointer to saved registers
+    cld                 ; Required by 32-bit System V ABI
+    call isr_handler
+    add esp, 4
+
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+
+    add esp, 8          ; Remove the interrupt and error code from stack
+    iret
+
 global gdt_flush
 
 gdt_flush:
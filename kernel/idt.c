@@ -1,5 +1,14 @@
 #include "types.h"
 #include "idt.h"
+#include "io.h"
+
+// 8259 PIC ports
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
 
 // IDT entry structure
 struct idt_entry {
@@ -31,6 +40,57 @@ void set_idt_gate(int num, uint32_t base, uint16_t sel, uint8_t flags) {
     idt[num].offset_high = (base >> 16) & 0xFFFF;
 }
 
+// Remap the PICs to IRQ_BASE and mask every line except the cascade
+static void pic_remap(void) {
+    outb(PIC1_COMMAND, 0x11);   // ICW1: init, expect ICW4
+    io_wait();
+    outb(PIC2_COMMAND, 0x11);
+    io_wait();
+    outb(PIC1_DATA, IRQ_BASE);  // ICW2: vector offsets
+    io_wait();
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    io_wait();
+    outb(PIC1_DATA, 0x04);      // ICW3: slave on IRQ2
+    io_wait();
+    outb(PIC2_DATA, 0x02);
+    io_wait();
+    outb(PIC1_DATA, 0x01);      // ICW4: 8086 mode
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+
+    outb(PIC1_DATA, (uint8_t)~(1 << IRQ_CASCADE));
+    outb(PIC2_DATA, 0xFF);
+}
+
+void pic_unmask_irq(int irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_mask_irq(int irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_send_eoi(int irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// IRQ 7 and 15 can fire without a matching in-service bit
+bool pic_is_spurious(int irq) {
+    if (irq != 7 && irq != 15) {
+        return false;
+    }
+
+    uint16_t port = irq < 8 ? PIC1_COMMAND : PIC2_COMMAND;
+    outb(port, PIC_READ_ISR);
+    return !(inb(port) & 0x80);
+}
+
 // Initialize the IDT
 void init_idt() {
     idtp.limit = sizeof(idt) - 1;
@@ -47,6 +107,19 @@ void init_idt() {
     set_idt_gate(0, (uint32_t)isr0, 0x08, 0x8E);   // Divide-by-zero
     set_idt_gate(0x80, (uint32_t)isr80, 0x08, 0x8E); // Syscall
 
+    // Hardware interrupts
+    extern void irq0(), irq1(), irq2(), irq3(), irq4(), irq5(), irq6(), irq7();
+    extern void irq8(), irq9(), irq10(), irq11(), irq12(), irq13(), irq14(), irq15();
+    void (*irqs[IRQ_COUNT])() = {
+        irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7,
+        irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
+    };
+    for (int i = 0; i < IRQ_COUNT; i++) {
+        set_idt_gate(IRQ_BASE + i, (uint32_t)irqs[i], 0x08, 0x8E);
+    }
+
+    pic_remap();
+
     // Load the IDT
     idt_flush((uint32_t)&idtp);
 }
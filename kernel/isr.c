@@ -4,12 +4,40 @@
 #include "libc/fileio.h"
 #include "keyboard.h"
 
+static irq_handler_t irq_handlers[IRQ_COUNT];
+
+void irq_install_handler(int irq, irq_handler_t handler) {
+    if (irq < 0 || irq >= IRQ_COUNT) {
+        return;
+    }
+    irq_handlers[irq] = handler;
+    pic_unmask_irq(irq);
+}
+
+static void irq_dispatch(struct registers_t *regs) {
+    int irq = regs->int_no - IRQ_BASE;
+
+    if (pic_is_spurious(irq)) {
+        // A spurious IRQ 15 still needs the master to be acknowledged
+        if (irq == 15) {
+            pic_send_eoi(0);
+        }
+        return;
+    }
+
+    if (irq_handlers[irq]) {
+        irq_handlers[irq](regs);
+    }
+    pic_send_eoi(irq);
+}
+
 void isr_handler(struct registers_t *regs) {
     uint32_t int_no = regs->int_no;
     uint32_t syscall_num = regs->eax;
     uint32_t arg1 = regs->ebx;
     uint32_t arg2 = regs->ecx;
     uint32_t arg3 = regs->edx;
+    uint32_t arg4 = regs->esi;
 
     if (int_no == 0x80) {
         switch (syscall_num) {
@@ -39,11 +67,37 @@ void isr_handler(struct registers_t *regs) {
             case 6: // Close file
                 regs->eax = fs_close((int)arg1);
                 break;
+
+            case 7: // Write cached data back to the disk
+                regs->eax = fs_sync() ? 0 : -1;
+                break;
+
+            case 8: // Read at an offset
+                regs->eax = fs_pread((int)arg1, (char*)arg2, (int)arg3, arg4);
+                break;
+
+            case 9: // Write at an offset
+                regs->eax = fs_pwrite((int)arg1, (const char*)arg2, (int)arg3, arg4);
+                break;
+
+            case 10: // Move the file position
+                regs->eax = fs_lseek((int)arg1, (int)arg2, (int)arg3);
+                break;
+
+            case 11: // File size and attributes
+                regs->eax = fs_fstat((int)arg1, (fs_stat_t*)arg2);
+                break;
+
+            case 12: // Cut or grow a file
+                regs->eax = fs_ftruncate((int)arg1, arg2);
+                break;
             default:
                 print("Unhandled syscall: ");
                 print(syscall_num + "");
                 print("\n");
         }
+    } else if (int_no >= IRQ_BASE && int_no < IRQ_BASE + IRQ_COUNT) {
+        irq_dispatch(regs);
     } else {
         print("Unhandled interrupt: ");
         print(regs->int_no + "");
@@ -5,8 +5,45 @@
 #include "shell.h"
 #include "idt.h"
 #include "gdt.h"
+#include "timer.h"
+#include "multiboot.h"
+#include "ramdisk.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "pci.h"
+#include "blockdev.h"
+#include "fat32.h"
+#include "bcache.h"
+#include "string.h"
+
+// Copy the value of "key=value" from the kernel command line
+static bool cmdline_get(const char* cmdline, const char* key, char* out, size_t out_len) {
+    size_t key_len = strlen(key);
+    const char* p = cmdline;
+
+    while (*p) {
+        while (*p == ' ') p++;
+
+        if (memcmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            p += key_len + 1;
+            size_t i = 0;
+            while (*p && *p != ' ' && i < out_len - 1) {
+                out[i++] = *p++;
+            }
+            out[i] = '\0';
+            return true;
+        }
+
+        while (*p && *p != ' ') p++;
+    }
+    return false;
+}
+
+void kernel_main(uint32_t magic, multiboot_info_t* mbi) {
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
+        mbi = NULL;
+    }
 
-void kernel_main(void) {
     // Initialize basic hardware
     vga_init();
     keyboard_init();
@@ -19,8 +56,18 @@ void kernel_main(void) {
     init_idt();
     vga_writestr("IDT init done.\n");
 
+    timer_init();
+    asm volatile("sti");
+
+    pci_init();
+
     
     vga_writestr("Initializing hardware...\n");
+
+    // RAM disks register first so they become the default root
+    if (ramdisk_init(mbi) > 0) {
+        vga_writestr("RAM disk loaded.\n");
+    }
     
     // Initialize ATA with retry
     int retries = 3;
@@ -28,23 +75,68 @@ void kernel_main(void) {
     
     while (retries-- && !ata_ok) {
         vga_writestr("Initializing ATA drive... ");
-        ata_ok = ata_init();
+        ata_ok = ata_init() > 0;
         if (!ata_ok) {
             vga_writestr("Failed, retrying...\n");
         }
     }
     
-    if (!ata_ok) {
+    if (ata_ok) {
+        vga_writestr("OK\n");
+    }
+
+    if (ahci_init() > 0) {
+        vga_writestr("AHCI drive found.\n");
+    }
+
+    if (virtio_blk_init() > 0) {
+        vga_writestr("virtio-blk device found.\n");
+    }
+    
+    if (blockdev_count() == 0) {
         vga_writestr("\nFATAL: Could not initialize ATA drive!\n");
         vga_writestr("System halted.\n");
         while(1);
     }
+
+    // root=<device> on the command line selects the volume to mount
+    char root[BLOCKDEV_NAME_LEN];
+    const char* root_device = NULL;
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        cmdline_get((const char*)mbi->cmdline, "root", root, sizeof(root))) {
+        root_device = root;
+    }
+
+    // discard=off keeps freed clusters from being trimmed on the device
+    char discard[4];
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        cmdline_get((const char*)mbi->cmdline, "discard", discard, sizeof(discard)) &&
+        strcmp(discard, "off") == 0) {
+        fat32_set_discard(false);
+    }
     
-    vga_writestr("OK\n");
-    
+    // bcache=<buffers> sizes the sector cache, 512 bytes each
+    char cache_size[11];
+    uint32_t cache_buffers = 0;
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        cmdline_get((const char*)mbi->cmdline, "bcache", cache_size, sizeof(cache_size))) {
+        for (const char* c = cache_size; *c >= '0' && *c <= '9'; c++) {
+            cache_buffers = cache_buffers * 10 + (*c - '0');
+        }
+    }
+    bcache_init(cache_buffers);
+
+    // writeback=off makes every metadata write go straight to the device
+    char writeback[4];
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        cmdline_get((const char*)mbi->cmdline, "writeback", writeback, sizeof(writeback)) &&
+        strcmp(writeback, "off") == 0) {
+        bcache_set_writeback(false);
+    }
+
     // Initialize filesystem
     vga_writestr("Initializing filesystem... ");
-    if (!fs_init()) {
+    if (!fs_init(root_device)) {
         vga_writestr("Failed.\n");
         vga_writestr("System halted.\n");
         while(1);
@@ -3,6 +3,12 @@
 #include <keyboard.h>
 #include <fat32.h>
 #include <loader.h>
+#include <ata.h>
+#include <timer.h>
+#include <pci.h>
+#include <blockdev.h>
+#include <bcache.h>
+#include <stdint.h>
 #include "libc/stdio.h"
 #include "programs/editor.h"
 
@@ -302,6 +308,302 @@ void cmd_exec(const char* filename) {
     print_prompt();
 }
 
+static void write_uint(uint32_t value) {
+    char str[11];
+    uint32_t_to_str(value, str);
+    vga_writestr(str);
+}
+
+// Position of the first ATA drive found at boot, -1 if there is none
+static int first_ata_drive(void) {
+    for (int i = 0; i < ATA_DRIVES; i++) {
+        if (ata_get_info(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Time sequential reads from the start of the disk
+static void cmd_diskbench(const char* arg) {
+    static uint8_t bench_buffer[128 * 512] __attribute__((aligned(16)));
+    const uint32_t total = 8192;
+    const uint32_t chunk = sizeof(bench_buffer) / 512;
+
+    int drive = first_ata_drive();
+    if (drive < 0) {
+        vga_writestr("\nNo ATA drive\n");
+        print_prompt();
+        return;
+    }
+
+    bool force_pio = arg && strcmp(arg, "pio") == 0;
+    ata_set_dma_enabled(!force_pio);
+
+    uint32_t start = timer_ticks();
+    bool ok = true;
+    for (uint32_t lba = 0; lba < total && ok; lba += chunk) {
+        ok = ata_read_sectors(drive, lba, chunk, bench_buffer);
+    }
+    uint32_t elapsed = timer_ticks() - start;
+
+    ata_set_dma_enabled(true);
+
+    if (!ok) {
+        vga_writestr("\nError: Read failed during benchmark\n");
+        print_prompt();
+        return;
+    }
+
+    vga_writestr("\nata");
+    write_uint(drive);
+    vga_writestr(" mode: ");
+    vga_writestr(ata_dma_enabled(drive) && !force_pio ? "DMA" : "PIO");
+    vga_writestr(", ");
+    write_uint(ata_multiple_sectors(drive));
+    vga_writestr(" sectors per DRQ block\n");
+    write_uint(total);
+    vga_writestr(" sectors in ");
+    write_uint(elapsed);
+    vga_writestr(" ms");
+    if (elapsed > 0) {
+        vga_writestr(" (");
+        write_uint(total * 1000 / elapsed);
+        vga_writestr(" sectors/s)");
+    }
+    vga_writestr("\n");
+    print_prompt();
+}
+
+static void write_hex(uint32_t value, int digits) {
+    char str[9];
+    for (int i = 0; i < digits; i++) {
+        uint8_t nibble = (value >> (4 * (digits - 1 - i))) & 0xF;
+        str[i] = nibble < 10 ? '0' + nibble : 'a' + nibble - 10;
+    }
+    str[digits] = '\0';
+    vga_writestr(str);
+}
+
+// One line per PCI function, then its decoded BARs
+static void cmd_lspci(void) {
+    vga_writestr("\n");
+    for (int i = 0; i < pci_device_count(); i++) {
+        pci_device_t* dev = pci_get_device(i);
+
+        write_hex(dev->addr.bus, 2);
+        vga_writestr(":");
+        write_hex(dev->addr.slot, 2);
+        vga_writestr(".");
+        write_hex(dev->addr.func, 1);
+        vga_writestr(" ");
+        write_hex(dev->vendor_id, 4);
+        vga_writestr(":");
+        write_hex(dev->device_id, 4);
+        vga_writestr(" class ");
+        write_hex(dev->class_code, 2);
+        write_hex(dev->subclass, 2);
+        if (dev->msi_cap) {
+            vga_writestr(" msi");
+        }
+        if (dev->driver) {
+            vga_writestr(" [");
+            vga_writestr(dev->driver->name);
+            vga_writestr("]");
+        }
+        vga_writestr("\n");
+
+        for (int b = 0; b < PCI_MAX_BARS; b++) {
+            if (!dev->bars[b].size) {
+                continue;
+            }
+            vga_writestr("  BAR");
+            write_uint(b);
+            vga_writestr(dev->bars[b].io ? " io  " : " mem ");
+            write_hex(dev->bars[b].base, 8);
+            vga_writestr(" size ");
+            write_uint(dev->bars[b].size);
+            vga_writestr("\n");
+        }
+    }
+    print_prompt();
+}
+
+static void write_modes(const char* label, uint8_t modes) {
+    vga_writestr(label);
+    if (!modes) {
+        vga_writestr(" none");
+    }
+    for (int mode = 0; mode < 8; mode++) {
+        if (modes & (1 << mode)) {
+            vga_writestr(" ");
+            write_uint(mode);
+        }
+    }
+    vga_writestr("\n");
+}
+
+// Latency buckets are log2 of TSC cycles, shown by their upper bound
+static void write_latency(const char* label, const uint32_t* buckets, uint32_t mhz) {
+    bool any = false;
+    for (int b = 0; b < BLOCKDEV_LAT_BUCKETS; b++) {
+        if (!buckets[b]) {
+            continue;
+        }
+        if (!any) {
+            vga_writestr(label);
+            any = true;
+        }
+        vga_writestr(" <");
+        if (mhz) {
+            uint32_t cycles = b >= 31 ? 0xFFFFFFFF : (1u << (b + 1));
+            write_uint(cycles / mhz);
+            vga_writestr("us:");
+        } else {
+            vga_writestr("2^");
+            write_uint(b + 1);
+            vga_writestr(":");
+        }
+        write_uint(buckets[b]);
+    }
+    if (any) {
+        vga_writestr("\n");
+    }
+}
+
+// Per-device block layer counters, "iostat reset" clears them
+static void cmd_iostat(const char* arg) {
+    bool reset = arg && strcmp(arg, "reset") == 0;
+    uint32_t mhz = timer_tsc_khz() / 1000;
+
+    vga_writestr("\n");
+    for (int i = 0; i < blockdev_count(); i++) {
+        blockdev_t* dev = blockdev_get_index(i);
+        blockdev_stats_t* stats = &dev->stats;
+
+        if (reset) {
+            blockdev_stats_reset(dev);
+            continue;
+        }
+
+        vga_writestr(dev->name);
+        vga_writestr(": rd ");
+        write_uint(stats->ops[BLOCKDEV_OP_READ]);
+        vga_writestr("/");
+        write_uint((uint32_t)stats->sectors[BLOCKDEV_OP_READ]);
+        vga_writestr("s wr ");
+        write_uint(stats->ops[BLOCKDEV_OP_WRITE]);
+        vga_writestr("/");
+        write_uint((uint32_t)stats->sectors[BLOCKDEV_OP_WRITE]);
+        vga_writestr("s flush ");
+        write_uint(stats->ops[BLOCKDEV_OP_FLUSH]);
+        vga_writestr(" trim ");
+        write_uint((uint32_t)stats->sectors[BLOCKDEV_OP_DISCARD]);
+        vga_writestr("s merged ");
+        write_uint(stats->merges);
+        vga_writestr(" err ");
+        write_uint(stats->errors);
+        vga_writestr("\n");
+
+        vga_writestr("  depth max ");
+        write_uint(stats->max_depth);
+        for (int b = 0; b < BLOCKDEV_DEPTH_BUCKETS; b++) {
+            if (stats->depth[b]) {
+                vga_writestr(" ");
+                write_uint(1u << b);
+                vga_writestr("+:");
+                write_uint(stats->depth[b]);
+            }
+        }
+        vga_writestr("\n");
+
+        write_latency("  rd lat", stats->latency[BLOCKDEV_OP_READ], mhz);
+        write_latency("  wr lat", stats->latency[BLOCKDEV_OP_WRITE], mhz);
+        write_latency("  fl lat", stats->latency[BLOCKDEV_OP_FLUSH], mhz);
+        write_latency("  tr lat", stats->latency[BLOCKDEV_OP_DISCARD], mhz);
+    }
+
+    const bcache_stats_t* cache = bcache_get_stats();
+    if (reset) {
+        bcache_reset_stats();
+        vga_writestr("I/O statistics cleared\n");
+    } else {
+        vga_writestr("cache: ");
+        write_uint(cache->buffers);
+        vga_writestr(" buffers, hits ");
+        write_uint(cache->hits);
+        vga_writestr(" misses ");
+        write_uint(cache->misses);
+        vga_writestr(" evictions ");
+        write_uint(cache->evictions);
+        vga_writestr(bcache_writeback_enabled() ? "\n  write-back: dirty " : "\n  write-through: dirty ");
+        write_uint(cache->dirty);
+        vga_writestr(" writes ");
+        write_uint(cache->writebacks);
+        vga_writestr(" sectors ");
+        write_uint(cache->written);
+        vga_writestr(" prefetched ");
+        write_uint(cache->prefetched);
+        vga_writestr("\n");
+    }
+    print_prompt();
+}
+
+static void write_yes_no(const char* label, bool value) {
+    vga_writestr(label);
+    vga_writestr(value ? "yes\n" : "no\n");
+}
+
+// Show what IDENTIFY reported and the mode chosen at init, per drive
+static void cmd_diskinfo(void) {
+    if (first_ata_drive() < 0) {
+        vga_writestr("\nNo ATA drive\n");
+        print_prompt();
+        return;
+    }
+
+    for (int drive = 0; drive < ATA_DRIVES; drive++) {
+        const ata_device_info_t* info = ata_get_info(drive);
+        if (!info) {
+            continue;
+        }
+
+        vga_writestr("\nata");
+        write_uint(drive);
+        vga_writestr(drive & 1 ? " (slave)" : " (master)");
+        vga_writestr("\nModel:       ");
+        vga_writestr(info->model);
+        vga_writestr("\nSerial:      ");
+        vga_writestr(info->serial);
+        vga_writestr("\nCapacity:    ");
+        write_uint((uint32_t)(info->sectors >> 11));
+        vga_writestr(" MiB\n");
+        write_yes_no("LBA48:       ", info->lba48);
+        vga_writestr("Multiple:    ");
+        write_uint(info->max_multiple);
+        vga_writestr(" sectors\n");
+        write_modes("PIO modes:  ", info->pio_modes);
+        write_modes("MWDMA modes:", info->mwdma_modes);
+        write_modes("UDMA modes: ", info->udma_modes);
+        write_yes_no("Write cache: ", info->write_cache_enabled);
+        write_yes_no("Flush:       ", info->flush || info->flush_ext);
+        write_yes_no("FUA:         ", info->fua);
+        write_yes_no("TRIM:        ", info->trim);
+
+        vga_writestr("Using:       ");
+        if ((info->xfer_mode & 0xF8) == ATA_XFER_UDMA) {
+            vga_writestr("UDMA ");
+        } else if ((info->xfer_mode & 0xF8) == ATA_XFER_MWDMA) {
+            vga_writestr("multiword DMA ");
+        } else {
+            vga_writestr("PIO ");
+        }
+        write_uint(info->xfer_mode & 0x07);
+        vga_writestr("\n");
+    }
+    print_prompt();
+}
+
 static void cmd_help(void) {
     vga_writestr("\nAvailable commands:");
     vga_writestr("\n  help   - Show this help message");
@@ -316,6 +618,11 @@ static void cmd_help(void) {
     vga_writestr("\n  cd     - Change directory");
     vga_writestr("\n  cat    - Read file content");
     vga_writestr("\n  exec   - Execute a binary");
+    vga_writestr("\n  diskbench - Measure disk read speed (diskbench pio)");
+    vga_writestr("\n  lspci  - List PCI devices");
+    vga_writestr("\n  diskinfo - Show ATA drive details");
+    vga_writestr("\n  iostat - Show block I/O statistics (iostat reset)");
+    vga_writestr("\n  sync   - Write cached changes to disk");
     vga_writestr("\n");
     print_prompt();
 }
@@ -521,6 +828,24 @@ void shell_process_command(void) {
     else if (strcmp(command, "exec") == 0) {
         cmd_exec(arg);
     }
+    else if (strcmp(command, "diskbench") == 0) {
+        cmd_diskbench(arg);
+    }
+    else if (strcmp(command, "diskinfo") == 0) {
+        cmd_diskinfo();
+    }
+    else if (strcmp(command, "lspci") == 0) {
+        cmd_lspci();
+    }
+    else if (strcmp(command, "iostat") == 0) {
+        cmd_iostat(arg);
+    }
+    else if (strcmp(command, "sync") == 0) {
+        if (!fat32_sync()) {
+            vga_writestr("Sync failed\n");
+        }
+        print_prompt();
+    }
     else if (strcmp(command, "int") == 0) {
         prints("Hello from syscall\n");
         // syscall_exit(0);
@@ -575,6 +900,13 @@ void shell_init(void) {
 
 void shell_run(void) {
     while (1) {
+        // Idle: let the flushers write back old dirty sectors
+        if (!keyboard_has_data()) {
+            fat32_tick();
+            bcache_tick();
+            continue;
+        }
+
         char c = keyboard_read();
         if (c) {
             shell_handle_keypress(c);
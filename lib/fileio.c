@@ -1,13 +1,20 @@
 #include "libc/fileio.h"
 #include "fat32.h"
+#include "blockdev.h"
 #include "string.h"
 #include "libc/stdio.h"
 
 static char current_path[256] = "/";
 
-// Initialize the filesystem
-bool fs_init() {
-    if (!fat32_init()) {
+// Initialize the filesystem on the named block device, or the first one
+bool fs_init(const char* root_device) {
+    blockdev_t* dev = root_device ? blockdev_get(root_device) : blockdev_get_index(0);
+    if (!dev) {
+        prints("Root device not found.\n");
+        return false;
+    }
+
+    if (!fat32_mount(dev)) {
         prints("FAT32 initialization failed.\n");
         return false;
     }
@@ -16,69 +23,163 @@ bool fs_init() {
     return true;
 }
 
-// Open a file
+static fs_file_t open_files[FS_MAX_OPEN];
+
+static fs_file_t* fs_get(int fd) {
+    if (fd < 0 || fd >= FS_MAX_OPEN || !open_files[fd].used) {
+        return NULL;
+    }
+    return &open_files[fd];
+}
+
+// Open a file, creating it in the writable modes
 int fs_open(const char* path, int mode) {
-    fat32_dir_entry_t entry;
-    if (fat32_find_file(path, &entry)) {
-        if ((entry.attributes & ATTR_DIRECTORY) && mode != 0) {
-            prints("Cannot open a directory in write mode.\n");
-            return -1;
-        }
-        return entry.first_cluster_low | (entry.first_cluster_high << 16); // File descriptor
+    int fd = 0;
+    while (fd < FS_MAX_OPEN && open_files[fd].used) {
+        fd++;
+    }
+    if (fd == FS_MAX_OPEN) {
+        prints("Too many open files.\n");
+        return -1;
     }
 
-    if (mode == 1) { // Create a new file if in write mode
-        if (!fat32_create_file(path)) {
-            prints("Failed to create file.\n");
-            return -1;
-        }
-        if (fat32_find_file(path, &entry)) {
-            return entry.first_cluster_low | (entry.first_cluster_high << 16);
-        }
+    fs_file_t* f = &open_files[fd];
+    if (!fat32_open(path, mode != FS_MODE_READ, &f->file)) {
+        return -1; // File not found or creation failed
+    }
+    if ((f->file.entry.attributes & ATTR_DIRECTORY) && mode != FS_MODE_READ) {
+        fat32_close(&f->file);
+        prints("Cannot open a directory in write mode.\n");
+        return -1;
     }
 
-    return -1; // File not found or creation failed
+    f->used = true;
+    f->mode = mode;
+    f->offset = 0;
+    return fd;
 }
 
-// Read from a file
-int fs_read(int fd, char* buffer, int size) {
-    fat32_dir_entry_t entry;
-    if (!fat32_find_file(fat32_get_current_path(), &entry)) {
-        prints("File not found.\n");
+// Read at an offset without moving the file position
+int fs_pread(int fd, char* buffer, int size, uint32_t offset) {
+    fs_file_t* f = fs_get(fd);
+    if (!f || !buffer || size < 0) {
         return -1;
     }
 
-    uint32_t bytes_read = 0;
-    if (!fat32_read_file(entry.name, buffer, &bytes_read)) {
+    uint32_t length = (uint32_t)size;
+    if (!fat32_read_at(&f->file, offset, buffer, &length)) {
         prints("Error reading file.\n");
         return -1;
     }
+    return (int)length;
+}
 
-    return (int)bytes_read;
+int fs_pwrite(int fd, const char* buffer, int size, uint32_t offset) {
+    fs_file_t* f = fs_get(fd);
+    if (!f || !buffer || size < 0 || f->mode == FS_MODE_READ) {
+        return -1;
+    }
+
+    if (!fat32_write_at(&f->file, offset, buffer, (uint32_t)size)) {
+        prints("Error writing to file.\n");
+        return -1;
+    }
+    return size;
+}
+
+// Read from the file position and move it past the bytes read
+int fs_read(int fd, char* buffer, int size) {
+    fs_file_t* f = fs_get(fd);
+    if (!f) {
+        return -1;
+    }
+
+    int read = fs_pread(fd, buffer, size, f->offset);
+    if (read > 0) {
+        f->offset += read;
+    }
+    return read;
 }
 
-// Write to a file
 int fs_write(int fd, const char* buffer, int size) {
-    fat32_dir_entry_t entry;
-    if (!fat32_find_file(fat32_get_current_path(), &entry)) {
-        prints("File not found.\n");
+    fs_file_t* f = fs_get(fd);
+    if (!f) {
         return -1;
     }
 
-    if (!fat32_write_file(entry.name, buffer, size)) {
-        prints("Error writing to file.\n");
+    if (f->mode == FS_MODE_APPEND) {
+        f->offset = f->file.entry.file_size;
+    }
+    int written = fs_pwrite(fd, buffer, size, f->offset);
+    if (written > 0) {
+        f->offset += written;
+    }
+    return written;
+}
+
+int fs_lseek(int fd, int offset, int whence) {
+    fs_file_t* f = fs_get(fd);
+    if (!f) {
         return -1;
     }
 
-    return size; // Number of bytes written
+    int64_t base;
+    switch (whence) {
+        case FS_SEEK_SET: base = 0; break;
+        case FS_SEEK_CUR: base = f->offset; break;
+        case FS_SEEK_END: base = f->file.entry.file_size; break;
+        default: return -1;
+    }
+
+    int64_t position = base + offset;
+    if (position < 0 || position > 0x7FFFFFFF) {
+        return -1;
+    }
+    f->offset = (uint32_t)position;
+    return (int)position;
+}
+
+int fs_ftruncate(int fd, uint32_t size) {
+    fs_file_t* f = fs_get(fd);
+    if (!f || f->mode == FS_MODE_READ) {
+        return -1;
+    }
+
+    if (!fat32_truncate(&f->file, size)) {
+        prints("Error truncating file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int fs_fstat(int fd, fs_stat_t* st) {
+    fs_file_t* f = fs_get(fd);
+    if (!f || !st) {
+        return -1;
+    }
+
+    st->size = f->file.entry.file_size;
+    st->attributes = f->file.entry.attributes;
+    return 0;
 }
 
 // Close a file
 int fs_close(int fd) {
-    // Placeholder for functionality, as FAT32 does not require explicit closing
+    fs_file_t* f = fs_get(fd);
+    if (!f) {
+        return -1;
+    }
+
+    fat32_close(&f->file);
+    f->used = false;
     return 0;
 }
 
+// Write every cached change back to the disk
+bool fs_sync(void) {
+    return fat32_sync();
+}
+
 // Change the current directory
 bool fs_chdir(const char* path) {
     if (fat32_change_directory(path)) {
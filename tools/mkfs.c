@@ -59,6 +59,16 @@ typedef struct {
     uint32_t file_size;
 } __attribute__((packed)) fat32_dir_entry_t;
 
+typedef struct {
+    uint32_t lead_signature;
+    uint8_t  reserved1[480];
+    uint32_t struct_signature;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t  reserved2[12];
+    uint32_t trail_signature;
+} __attribute__((packed)) fat32_fsinfo_t;
+
 typedef struct {
     unsigned char* buffer;
     size_t size;
@@ -351,6 +361,28 @@ static int process_directory(filesystem_image* fs, const char* path, const char*
     return ret;
 }
 
+// Record the free cluster count and next free cluster in the FSInfo sector
+static void write_fsinfo(filesystem_image* fs) {
+    fat32_boot_sector_t* bs = (fat32_boot_sector_t*)fs->buffer;
+    fat32_fsinfo_t* info = (fat32_fsinfo_t*)(fs->buffer + bs->fs_info * SECTOR_SIZE);
+    uint32_t* fat = (uint32_t*)(fs->buffer + fs->fat_start);
+    uint32_t total_clusters = (fs->size - fs->cluster_start) / (bs->sectors_per_cluster * SECTOR_SIZE);
+
+    uint32_t free_count = 0;
+    for (uint32_t cluster = 2; cluster < total_clusters + 2; cluster++) {
+        if ((fat[cluster] & 0x0FFFFFFF) == 0) {
+            free_count++;
+        }
+    }
+
+    memset(info, 0, sizeof(fat32_fsinfo_t));
+    info->lead_signature = 0x41615252;
+    info->struct_signature = 0x61417272;
+    info->free_count = free_count;
+    info->next_free = fs->next_free_cluster;
+    info->trail_signature = 0xAA550000;
+}
+
 static int create_filesystem_image(const char* source_dir, const char* output_file) {
     filesystem_image* fs = create_filesystem();
     if (!fs) return -1;
@@ -359,6 +391,8 @@ static int create_filesystem_image(const char* source_dir, const char* output_fi
     int ret = process_directory(fs, source_dir, "", 0);  // 0 indicates root directory
 
     if (ret == 0) {
+        write_fsinfo(fs);
+
         FILE* out = fopen(output_file, "wb");
         if (!out) {
             fprintf(stderr, "Error creating output file %s: %s\n", output_file, strerror(errno));